@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# Runs wiegand_loopback_bench with wiegand_out looped back into wiegand_in
+# on the gpio-sim bank of wiegand-gpio-sim.dtsi. Extra arguments are passed
+# to the bench.
+#
+# A leading "-e gpio" runs the userspace engine of the HAL on the same bank
+# instead: the drivers are unbound from it for the run, and the bench must
+# be built with WIEGAND_HAL (see the Makefile).
+
+DIR=$(dirname "$0")
+
+ENGINE=kernel
+if [ "$1" = "-e" ]; then
+    ENGINE=$2
+    shift 2
+fi
+
+CHIP=$(dirname "$(ls -d /sys/devices/platform/*gpio-sim*/gpiochip*/sim_gpio3 2>/dev/null | head -n 1)")
+if [ ! -d "$CHIP/sim_gpio0" ]; then
+    echo "no gpio-sim bank found, is wiegand-gpio-sim.dtsi in the device tree?" >&2
+    exit 1
+fi
+
+UNBOUND=
+rebind() {
+    for dev in $UNBOUND; do
+        echo "${dev#*/}" > "/sys/bus/platform/drivers/${dev%%/*}/bind"
+    done
+    UNBOUND=
+}
+
+if [ "$ENGINE" = "gpio" ]; then
+    for drv in wiegand_in wiegand_out; do
+        for dev in /sys/bus/platform/drivers/$drv/*/; do
+            [ -e "$dev/driver" ] || continue
+            dev=$(basename "$dev")
+            echo "$dev" > "/sys/bus/platform/drivers/$drv/unbind"
+            UNBOUND="$UNBOUND $drv/$dev"
+        done
+    done
+    set -- -e gpio -c "$(basename "$CHIP")" "$@"
+fi
+
+# The relay busy polls, give it the last CPU and keep that one out of the numbers
+RELAY_CPU=$(($(nproc) - 1))
+taskset -c "$RELAY_CPU" "$DIR/wiegand_relay" "$CHIP" -f &
+RELAY=$!
+trap 'kill $RELAY 2>/dev/null; rebind' EXIT INT TERM
+sleep 1
+
+if [ "$RELAY_CPU" -gt 0 ]; then
+    taskset -c 0-$((RELAY_CPU - 1)) "$DIR/wiegand_loopback_bench" -x "$RELAY_CPU" "$@"
+else
+    "$DIR/wiegand_loopback_bench" "$@"
+fi
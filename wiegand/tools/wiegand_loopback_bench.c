@@ -0,0 +1,408 @@
+/*
+ * Copyright 2021 Bob Shen.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Sends frames from /dev/wiegand_out and checks what /dev/wiegand_in
+ * decodes, with wiegand_out looped back into wiegand_in (see
+ * wiegand_relay.c). For each pulse width, pulse interval and inter-frame
+ * gap it reports the frame rate, the decode errors and the CPU time spent
+ * per frame, then the highest rate sustained under the error threshold.
+ *
+ * Built with WIEGAND_GPIO_ENGINE (see the Makefile), -e gpio runs the same
+ * sweep on the userspace engine of the HAL instead, on the lines of the
+ * gpio-sim bank, so both paths can be compared on the same wire.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../wiegand_uapi.h"
+#ifdef WIEGAND_GPIO_ENGINE
+#include "wiegand_gpio.h"
+#endif
+
+#define MAX_LIST    16
+#define MAX_FRAMES  100000
+
+struct step_result {
+    unsigned int ok;
+    unsigned int parity_errors;
+    unsigned int length_errors;
+    unsigned int mismatches;
+    unsigned int missing;
+    double seconds;
+    double cpu_us;          /* all CPUs but the excluded one, per frame sent */
+};
+
+static int in_fd, out_fd;
+#ifdef WIEGAND_GPIO_ENGINE
+static struct wiegand_gpio_in* gpio_in;
+static struct wiegand_gpio_out* gpio_out;
+#endif
+static int frames = 200;
+static int format = WIEGAND_MODE_26;
+static int exclude_cpu = -1;
+static double threshold = 0.01;
+static unsigned int expected[MAX_FRAMES];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static int parse_list(const char* arg, int* list)
+{
+    char* copy = strdup(arg);
+    char* save = NULL;
+    char* tok;
+    int n = 0;
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL && n < MAX_LIST;
+         tok = strtok_r(NULL, ",", &save)) {
+        list[n++] = atoi(tok);
+    }
+    free(copy);
+    return n;
+}
+
+/* Busy jiffies of every CPU but exclude_cpu, irq and softirq included */
+static uint64_t busy_ticks(void)
+{
+    unsigned long long v[10];
+    uint64_t busy = 0;
+    char line[256];
+    int cpu;
+    FILE* f = fopen("/proc/stat", "re");
+
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        memset(v, 0, sizeof(v));
+        if (sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu", &cpu,
+                   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 8) {
+            continue;
+        }
+        if (cpu == exclude_cpu) {
+            continue;
+        }
+        /* user nice system idle iowait irq softirq steal */
+        busy += v[0] + v[1] + v[2] + v[5] + v[6];
+    }
+    fclose(f);
+    return busy;
+}
+
+static int set_int(int fd, unsigned long cmd, int value)
+{
+    return ioctl(fd, cmd, &value);
+}
+
+#ifdef WIEGAND_GPIO_ENGINE
+/* Lines 0/1 are driven, 2/3 read, as in wiegand-gpio-sim.dtsi */
+static int gpio_open(const char* chip)
+{
+    struct wiegand_gpio_lines lines;
+    char spec[64];
+    int error = 0;
+
+    snprintf(spec, sizeof(spec), "%s 2 3", chip);
+    wiegand_gpio_parse_lines(spec, &lines);
+    gpio_in = wiegand_gpio_in_open(0, &lines, &error);
+    if (gpio_in == NULL) {
+        fprintf(stderr, "gpio input on %s: %s\n", chip, strerror(-error));
+        return -1;
+    }
+    snprintf(spec, sizeof(spec), "%s 0 1", chip);
+    wiegand_gpio_parse_lines(spec, &lines);
+    gpio_out = wiegand_gpio_out_open(0, &lines, &error);
+    if (gpio_out == NULL) {
+        fprintf(stderr, "gpio output on %s: %s\n", chip, strerror(-error));
+        return -1;
+    }
+    return 0;
+}
+
+static int gpio_configure(int width, int interval)
+{
+    struct wiegand_config cfg;
+
+    wiegand_gpio_in_get_config(gpio_in, &cfg);
+    cfg.pulse_width = width;
+    cfg.pulse_intval = interval;
+    cfg.format = format;
+    if (wiegand_gpio_in_set_config(gpio_in, &cfg) < 0) {
+        return -1;
+    }
+    wiegand_gpio_out_get_config(gpio_out, &cfg);
+    cfg.pulse_width = width;
+    cfg.pulse_intval = interval;
+    cfg.format = format;
+    return wiegand_gpio_out_set_config(gpio_out, &cfg);
+}
+#endif
+
+static int configure(int width, int interval)
+{
+    int fds[2] = { in_fd, out_fd };
+    int i;
+
+#ifdef WIEGAND_GPIO_ENGINE
+    if (gpio_in != NULL) {
+        if (gpio_configure(width, interval) < 0) {
+            fprintf(stderr, "configure: invalid pulse width or interval\n");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    for (i = 0; i < 2; i++) {
+        if (set_int(fds[i], WIEGAND_PULSE_WIDTH, width) < 0
+                || set_int(fds[i], WIEGAND_PULSE_INTERVAL, interval) < 0
+                || set_int(fds[i], WIEGAND_FORMAT, format) < 0) {
+            perror("configure");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Match every received frame against the next expected one */
+static void collect(struct step_result* result, int* received)
+{
+    struct wiegand_frame batch[16];
+    struct wiegand_frames req;
+    int i, n;
+
+    for (;;) {
+#ifdef WIEGAND_GPIO_ENGINE
+        if (gpio_in != NULL) {
+            n = wiegand_gpio_in_read_frames(gpio_in, batch, 16);
+        } else
+#endif
+        {
+            req.frames = (uintptr_t)batch;
+            req.count = 16;
+            req.flags = 0;
+            n = ioctl(in_fd, WIEGAND_READ_FRAMES, &req);
+        }
+        if (n <= 0) {
+            return;
+        }
+        for (i = 0; i < n; i++) {
+            if (batch[i].status == WIEGAND_FRAME_LENGTH_ERROR) {
+                result->length_errors++;
+            } else if (batch[i].status == WIEGAND_FRAME_PARITY_ERROR) {
+                result->parity_errors++;
+            } else if (*received < frames && batch[i].data == expected[*received]) {
+                result->ok++;
+            } else {
+                result->mismatches++;
+            }
+            (*received)++;
+        }
+    }
+}
+
+/* Returns once the previous frame has left the wire */
+static int send_frame(unsigned int data)
+{
+#ifdef WIEGAND_GPIO_ENGINE
+    if (gpio_out != NULL) {
+        int ret = wiegand_gpio_out_write(gpio_out, data);
+
+        errno = -ret;
+        return ret < 0 ? -1 : 0;
+    }
+#endif
+    return set_int(out_fd, WIEGAND_WRITE, data);
+}
+
+static void run_step(int width, int interval, int gap_bits, struct step_result* result)
+{
+    uint64_t bit_ns = (uint64_t)(width + interval) * 1000;
+    uint64_t frame_ns = bit_ns * format;
+    uint64_t start, next, ticks;
+    unsigned int mask = format >= 34 ? 0xffffffff : (1U << (format - 2)) - 1;
+    long hz = sysconf(_SC_CLK_TCK);
+    int i, received = 0;
+
+    memset(result, 0, sizeof(*result));
+    collect(result, &received);
+    memset(result, 0, sizeof(*result));
+    received = 0;
+
+    ticks = busy_ticks();
+    start = next = now_ns();
+    for (i = 0; i < frames; i++) {
+        unsigned int data = (unsigned int)random() & mask;
+
+        expected[i] = data;
+        sleep_until(next);
+        if (send_frame(data) < 0) {
+            perror("WIEGAND_WRITE");
+            break;
+        }
+        next = now_ns() + frame_ns + gap_bits * bit_ns;
+        collect(result, &received);
+    }
+
+    /* The last frame, its decode window and a scheduling margin */
+    sleep_until(next + 2 * frame_ns + 20000000ULL);
+    collect(result, &received);
+    result->seconds = (now_ns() - start) / 1e9;
+    result->cpu_us = (busy_ticks() - ticks) * 1e6 / hz / frames;
+    result->missing = received < frames ? frames - received : 0;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [-n frames] [-f 26|34] [-w widths] [-i intervals] [-g gaps]\n"
+            "          [-x cpu] [-t error threshold]"
+#ifdef WIEGAND_GPIO_ENGINE
+            " [-e kernel|gpio -c gpiochipN]"
+#endif
+            "\n"
+            "  -w, -i  comma separated pulse widths and intervals in us\n"
+            "  -g      comma separated inter-frame gaps, in bit periods\n"
+            "  -x      CPU left out of the CPU accounting, the one running wiegand_relay\n"
+#ifdef WIEGAND_GPIO_ENGINE
+            "  -e      gpio runs the userspace engine on the gpio-sim chip -c, with the\n"
+            "          drivers unbound from it\n"
+#endif
+            ,
+            name);
+}
+
+int main(int argc, char** argv)
+{
+    int widths[MAX_LIST] = { 100, 50, 20 }, nwidths = 3;
+    int intervals[MAX_LIST] = { 1000, 500, 200 }, nintervals = 3;
+    int gaps[MAX_LIST] = { 8, 4, 2, 1 }, ngaps = 4;
+    struct step_result r;
+    double best_fps = 0, fps, errors;
+    int best_w = 0, best_i = 0, best_g = 0;
+    int opt, w, i, g;
+    const char* engine = "kernel";
+#ifdef WIEGAND_GPIO_ENGINE
+    const char* chip = NULL;
+#endif
+
+    while ((opt = getopt(argc, argv, "n:f:w:i:g:x:t:e:c:")) != -1) {
+        switch (opt) {
+        case 'n': frames = atoi(optarg); break;
+        case 'f': format = atoi(optarg); break;
+        case 'w': nwidths = parse_list(optarg, widths); break;
+        case 'i': nintervals = parse_list(optarg, intervals); break;
+        case 'g': ngaps = parse_list(optarg, gaps); break;
+        case 'x': exclude_cpu = atoi(optarg); break;
+        case 't': threshold = atof(optarg); break;
+        case 'e': engine = optarg; break;
+#ifdef WIEGAND_GPIO_ENGINE
+        case 'c': chip = optarg; break;
+#endif
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (frames <= 0 || frames > MAX_FRAMES
+            || (format != WIEGAND_MODE_26 && format != WIEGAND_MODE_34)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (strcmp(engine, "gpio") == 0) {
+#ifdef WIEGAND_GPIO_ENGINE
+        if (chip == NULL) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (gpio_open(chip) < 0) {
+            return 1;
+        }
+#else
+        fprintf(stderr, "built without WIEGAND_GPIO_ENGINE\n");
+        return 1;
+#endif
+    } else if (strcmp(engine, "kernel") != 0) {
+        usage(argv[0]);
+        return 1;
+    } else {
+        in_fd = open("/dev/" WIEGAND_IN_DEVICE_NAME, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        out_fd = open("/dev/" WIEGAND_OUT_DEVICE_NAME, O_RDWR | O_CLOEXEC);
+        if (in_fd < 0 || out_fd < 0) {
+            perror("open");
+            return 1;
+        }
+    }
+    srandom(time(NULL));
+
+    printf("%6s %6s %4s %9s %7s %7s %7s %7s %7s %9s\n", "width", "intval", "gap",
+           "frames/s", "ok", "parity", "length", "wrong", "missing", "cpu us/f");
+    for (w = 0; w < nwidths; w++) {
+        for (i = 0; i < nintervals; i++) {
+            if (configure(widths[w], intervals[i]) < 0) {
+                return 1;
+            }
+            for (g = 0; g < ngaps; g++) {
+                run_step(widths[w], intervals[i], gaps[g], &r);
+                fps = r.ok / r.seconds;
+                errors = 1.0 - (double)r.ok / frames;
+                printf("%6d %6d %4d %9.1f %7u %7u %7u %7u %7u %9.1f\n",
+                       widths[w], intervals[i], gaps[g], fps, r.ok, r.parity_errors,
+                       r.length_errors, r.mismatches, r.missing, r.cpu_us);
+                fflush(stdout);
+                if (errors <= threshold && fps > best_fps) {
+                    best_fps = fps;
+                    best_w = widths[w];
+                    best_i = intervals[i];
+                    best_g = gaps[g];
+                }
+            }
+        }
+    }
+
+    if (best_fps > 0) {
+        printf("max sustainable: %.1f frames/s at width=%dus intval=%dus gap=%d bits (errors <= %.1f%%)\n",
+               best_fps, best_w, best_i, best_g, threshold * 100);
+    } else {
+        printf("no setting stayed under %.1f%% errors\n", threshold * 100);
+    }
+#ifdef WIEGAND_GPIO_ENGINE
+    if (gpio_out != NULL) {
+        printf("late edges: %llu\n", (unsigned long long)wiegand_gpio_out_late_edges(gpio_out));
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2021 Bob Shen.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Wires wiegand_out to wiegand_in on a gpio-sim bank (see
+ * wiegand-gpio-sim.dtsi): the lines driven by wiegand_out, 0 and 1, are
+ * copied to the pulls of the lines read by wiegand_in, 2 and 3.
+ *
+ * gpio-sim has no notification for output changes, so the relay busy
+ * polls; pin it to a CPU of its own and keep that CPU out of benchmarks.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OUT_DATA0   0
+#define OUT_DATA1   1
+#define IN_DATA0    2
+#define IN_DATA1    3
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig)
+{
+    stopping = 1;
+}
+
+static int open_attr(const char* chip, int line, const char* attr, int flags)
+{
+    char path[256];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/sim_gpio%d/%s", chip, line, attr);
+    fd = open(path, flags | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "wiegand_relay: can't open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+static int read_value(int fd)
+{
+    char c;
+
+    if (pread(fd, &c, 1, 0) != 1) {
+        return -1;
+    }
+    return c == '1';
+}
+
+static void set_pull(int fd, int value)
+{
+    const char* pull = value ? "pull-up" : "pull-down";
+
+    if (pwrite(fd, pull, strlen(pull), 0) < 0) {
+        fprintf(stderr, "wiegand_relay: set pull failed: %s\n", strerror(errno));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct sched_param param = { .sched_priority = 50 };
+    unsigned long long edges = 0;
+    int value_fd[2], pull_fd[2], last[2] = { 1, 1 };
+    int i, v;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <gpio-sim chip dir> [-f]\n"
+                "  e.g. /sys/devices/platform/gpio-sim/gpiochip0\n"
+                "  -f  run as SCHED_FIFO\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2 && !strcmp(argv[2], "-f")
+            && sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+        fprintf(stderr, "wiegand_relay: SCHED_FIFO: %s\n", strerror(errno));
+    }
+
+    value_fd[0] = open_attr(argv[1], OUT_DATA0, "value", O_RDONLY);
+    value_fd[1] = open_attr(argv[1], OUT_DATA1, "value", O_RDONLY);
+    pull_fd[0] = open_attr(argv[1], IN_DATA0, "pull", O_WRONLY);
+    pull_fd[1] = open_attr(argv[1], IN_DATA1, "pull", O_WRONLY);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    /* Both lines idle high */
+    set_pull(pull_fd[0], 1);
+    set_pull(pull_fd[1], 1);
+
+    while (!stopping) {
+        for (i = 0; i < 2; i++) {
+            v = read_value(value_fd[i]);
+            if (v >= 0 && v != last[i]) {
+                set_pull(pull_fd[i], v);
+                last[i] = v;
+                edges++;
+            }
+        }
+    }
+
+    fprintf(stderr, "wiegand_relay: %llu edges relayed\n", edges);
+    return 0;
+}
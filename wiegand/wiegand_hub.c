@@ -0,0 +1,416 @@
+/*
+ * Copyright 2021 Bob Shen.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * /dev/wiegand_hub serves every port through one fd: reads return the
+ * frames of all wiegand_in ports in the order they were queued, writes
+ * send on any wiegand_out port. The per-port nodes keep working next to
+ * it, an output port sends the frames of both back to back.
+ */
+
+#include <linux/atomic.h>
+#include <linux/device.h>
+#include <linux/errno.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/kfifo.h>
+#include <linux/miscdevice.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/wait.h>
+
+#include "wiegand_uapi.h"
+#include "wiegand_hub.h"
+
+#define WIEGAND_HUB_FIFO_SIZE   64 //frames
+
+struct wiegand_hub_dev {
+    struct miscdevice       mdev;
+    struct mutex            ports_lock;     /* the port lists and open */
+    struct list_head        in_ports;
+    struct list_head        out_ports;
+    bool                    open;
+    /* Taken from the wiegand_in hrtimers */
+    spinlock_t              lock;
+    bool                    reading;        /* frames are queued */
+    u64                     seq;
+    DECLARE_KFIFO(frames, struct wiegand_hub_frame, WIEGAND_HUB_FIFO_SIZE);
+    atomic_t                out_idle;       /* bumped whenever an output port goes idle */
+    wait_queue_head_t       wq;
+};
+
+static struct wiegand_hub_dev wiegand_hub;
+
+void wiegand_hub_frame(const struct wiegand_frame *frame)
+{
+    struct wiegand_hub_frame record;
+    unsigned long flags;
+    bool dropped = false;
+
+    spin_lock_irqsave(&wiegand_hub.lock, flags);
+    if (wiegand_hub.reading) {
+        record.seq = ++wiegand_hub.seq;
+        record.frame = *frame;
+        dropped = !kfifo_put(&wiegand_hub.frames, record);
+        wake_up_interruptible(&wiegand_hub.wq);
+    }
+    spin_unlock_irqrestore(&wiegand_hub.lock, flags);
+
+    if (dropped) {
+        dev_warn_ratelimited(wiegand_hub.mdev.this_device, "%s: hub fifo full, frame dropped\n",
+                             __func__);
+    }
+}
+EXPORT_SYMBOL_GPL(wiegand_hub_frame);
+
+void wiegand_hub_out_idle(void)
+{
+    atomic_inc(&wiegand_hub.out_idle);
+    wake_up_interruptible(&wiegand_hub.wq);
+}
+EXPORT_SYMBOL_GPL(wiegand_hub_out_idle);
+
+void wiegand_hub_add_in(struct wiegand_hub_in *in)
+{
+    mutex_lock(&wiegand_hub.ports_lock);
+    list_add_tail(&in->node, &wiegand_hub.in_ports);
+    if (wiegand_hub.open) {
+        in->attach(in);
+    }
+    mutex_unlock(&wiegand_hub.ports_lock);
+}
+EXPORT_SYMBOL_GPL(wiegand_hub_add_in);
+
+void wiegand_hub_del_in(struct wiegand_hub_in *in)
+{
+    mutex_lock(&wiegand_hub.ports_lock);
+    list_del(&in->node);
+    if (wiegand_hub.open) {
+        in->detach(in);
+    }
+    mutex_unlock(&wiegand_hub.ports_lock);
+}
+EXPORT_SYMBOL_GPL(wiegand_hub_del_in);
+
+void wiegand_hub_add_out(struct wiegand_hub_out *out)
+{
+    mutex_lock(&wiegand_hub.ports_lock);
+    list_add_tail(&out->node, &wiegand_hub.out_ports);
+    mutex_unlock(&wiegand_hub.ports_lock);
+}
+EXPORT_SYMBOL_GPL(wiegand_hub_add_out);
+
+/* Once it returns the hub doesn't call into the port anymore */
+void wiegand_hub_del_out(struct wiegand_hub_out *out)
+{
+    mutex_lock(&wiegand_hub.ports_lock);
+    list_del(&out->node);
+    mutex_unlock(&wiegand_hub.ports_lock);
+}
+EXPORT_SYMBOL_GPL(wiegand_hub_del_out);
+
+static bool wiegand_hub_get_frame(struct wiegand_hub_frame *record)
+{
+    unsigned long flags;
+    unsigned int n;
+
+    spin_lock_irqsave(&wiegand_hub.lock, flags);
+    n = kfifo_out(&wiegand_hub.frames, record, 1);
+    spin_unlock_irqrestore(&wiegand_hub.lock, flags);
+    return n == 1;
+}
+
+/* Start req on its port, -EAGAIN while the port is busy */
+static int wiegand_hub_try_send(const struct wiegand_hub_write *req)
+{
+    struct wiegand_hub_out *out;
+    int ret = -ENODEV;
+
+    mutex_lock(&wiegand_hub.ports_lock);
+    list_for_each_entry(out, &wiegand_hub.out_ports, node) {
+        if (out->port == req->port) {
+            ret = out->write(out, req->data);
+            break;
+        }
+    }
+    mutex_unlock(&wiegand_hub.ports_lock);
+    return ret;
+}
+
+static int wiegand_hub_send(const struct wiegand_hub_write *req, bool nonblock)
+{
+    int idle, ret;
+
+    for (;;) {
+        /* Sampled first, a port going idle after the attempt still wakes us */
+        idle = atomic_read(&wiegand_hub.out_idle);
+        ret = wiegand_hub_try_send(req);
+        if (ret != -EAGAIN || nonblock) {
+            return ret;
+        }
+        if (wait_event_interruptible(wiegand_hub.wq, atomic_read(&wiegand_hub.out_idle) != idle)) {
+            return -ERESTARTSYS;
+        }
+    }
+}
+
+int wiegand_hub_forward(int port, u32 data)
+{
+    struct wiegand_hub_write req = {
+        .data = data,
+        .port = port,
+    };
+
+    return wiegand_hub_send(&req, false);
+}
+EXPORT_SYMBOL_GPL(wiegand_hub_forward);
+
+static int wiegand_hub_open(struct inode *inode, struct file *filp)
+{
+    struct wiegand_hub_in *in;
+
+    mutex_lock(&wiegand_hub.ports_lock);
+    if (wiegand_hub.open) {
+        mutex_unlock(&wiegand_hub.ports_lock);
+        return -EBUSY;
+    }
+    wiegand_hub.open = true;
+
+    spin_lock_irq(&wiegand_hub.lock);
+    kfifo_reset(&wiegand_hub.frames);
+    wiegand_hub.seq = 0;
+    wiegand_hub.reading = true;
+    spin_unlock_irq(&wiegand_hub.lock);
+
+    list_for_each_entry(in, &wiegand_hub.in_ports, node) {
+        in->attach(in);
+    }
+    mutex_unlock(&wiegand_hub.ports_lock);
+    return 0;
+}
+
+static int wiegand_hub_release(struct inode *inode, struct file *filp)
+{
+    struct wiegand_hub_in *in;
+
+    mutex_lock(&wiegand_hub.ports_lock);
+    list_for_each_entry(in, &wiegand_hub.in_ports, node) {
+        in->detach(in);
+    }
+
+    spin_lock_irq(&wiegand_hub.lock);
+    wiegand_hub.reading = false;
+    spin_unlock_irq(&wiegand_hub.lock);
+
+    wiegand_hub.open = false;
+    mutex_unlock(&wiegand_hub.ports_lock);
+    return 0;
+}
+
+static bool wiegand_hub_nonblock(struct kiocb *iocb)
+{
+#ifdef IOCB_NOWAIT
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        return true;
+    }
+#endif
+    return iocb->ki_filp->f_flags & O_NONBLOCK;
+}
+
+/* As many whole records as fit, blocks for the first one unless non-blocking */
+static ssize_t wiegand_hub_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct wiegand_hub_frame record;
+    ssize_t n = 0;
+
+    if (iov_iter_count(to) < sizeof(record)) {
+        return -EINVAL;
+    }
+
+    while (!wiegand_hub_get_frame(&record)) {
+        if (wiegand_hub_nonblock(iocb)) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(wiegand_hub.wq, !kfifo_is_empty(&wiegand_hub.frames))) {
+            return -ERESTARTSYS;
+        }
+    }
+
+    do {
+        if (copy_to_iter(&record, sizeof(record), to) != sizeof(record)) {
+            return n ? n : -EFAULT;
+        }
+        n += sizeof(record);
+    } while (iov_iter_count(to) >= sizeof(record) && wiegand_hub_get_frame(&record));
+
+    return n;
+}
+
+/*
+ * Starts the frame of each struct wiegand_hub_write in turn and returns
+ * the bytes of those started. A blocking write waits for the port of the
+ * next one to be idle, a non-blocking one stops there, poll for POLLOUT.
+ * Like WIEGAND_WRITE, it doesn't wait for the last frame to be sent.
+ */
+static ssize_t wiegand_hub_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct wiegand_hub_write req;
+    bool nonblock = wiegand_hub_nonblock(iocb);
+    ssize_t n = 0;
+    int ret = 0;
+
+    if (iov_iter_count(from) < sizeof(req) || iov_iter_count(from) % sizeof(req)) {
+        return -EINVAL;
+    }
+
+    while (iov_iter_count(from) >= sizeof(req)) {
+        if (copy_from_iter(&req, sizeof(req), from) != sizeof(req)) {
+            ret = -EFAULT;
+            break;
+        }
+        if (req.flags) {
+            ret = -EINVAL;
+            break;
+        }
+        ret = wiegand_hub_send(&req, nonblock);
+        if (ret) {
+            break;
+        }
+        n += sizeof(req);
+    }
+
+    return n ? n : ret;
+}
+
+/* POLLOUT once no output port is busy, any single write goes through then */
+static unsigned int wiegand_hub_poll(struct file *filp, poll_table *wait)
+{
+    unsigned int mask = 0;
+    struct wiegand_hub_out *out;
+    bool busy = false;
+
+    poll_wait(filp, &wiegand_hub.wq, wait);
+
+    if (!kfifo_is_empty(&wiegand_hub.frames)) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+
+    mutex_lock(&wiegand_hub.ports_lock);
+    list_for_each_entry(out, &wiegand_hub.out_ports, node) {
+        busy |= out->busy(out);
+    }
+    mutex_unlock(&wiegand_hub.ports_lock);
+    if (!busy) {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+
+    return mask;
+}
+
+static long wiegand_hub_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+        case WIEGAND_HUB_GET_PORTS: {
+                struct wiegand_hub_ports ports = { 0, 0 };
+                struct wiegand_hub_in *in;
+                struct wiegand_hub_out *out;
+
+                /* Ports from 32 on are served but not listed */
+                mutex_lock(&wiegand_hub.ports_lock);
+                list_for_each_entry(in, &wiegand_hub.in_ports, node) {
+                    if (in->port < 32) {
+                        ports.in |= BIT(in->port);
+                    }
+                }
+                list_for_each_entry(out, &wiegand_hub.out_ports, node) {
+                    if (out->port < 32) {
+                        ports.out |= BIT(out->port);
+                    }
+                }
+                mutex_unlock(&wiegand_hub.ports_lock);
+
+                if (copy_to_user((void __user *)arg, &ports, sizeof(ports))) {
+                    return -EFAULT;
+                }
+                break;
+            }
+
+        case WIEGAND_GET_VERSION: {
+                if (put_user(WIEGAND_UAPI_VERSION, (__u32 __user *)arg)) {
+                    return -EFAULT;
+                }
+                break;
+            }
+
+        default:
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+static struct file_operations wiegand_hub_misc_fops = {
+    .owner      = THIS_MODULE,
+    .open       = wiegand_hub_open,
+    .release    = wiegand_hub_release,
+    .read_iter  = wiegand_hub_read_iter,
+    .write_iter = wiegand_hub_write_iter,
+    .unlocked_ioctl = wiegand_hub_ioctl,
+    .poll       = wiegand_hub_poll,
+};
+
+/* Linked ahead of wiegand_in and wiegand_out, so it is ready before their probes */
+static int __init wiegand_hub_init(void)
+{
+    int ret;
+
+    mutex_init(&wiegand_hub.ports_lock);
+    INIT_LIST_HEAD(&wiegand_hub.in_ports);
+    INIT_LIST_HEAD(&wiegand_hub.out_ports);
+    spin_lock_init(&wiegand_hub.lock);
+    INIT_KFIFO(wiegand_hub.frames);
+    atomic_set(&wiegand_hub.out_idle, 0);
+    init_waitqueue_head(&wiegand_hub.wq);
+
+    wiegand_hub.mdev.minor = MISC_DYNAMIC_MINOR;
+    wiegand_hub.mdev.name = WIEGAND_HUB_DEVICE_NAME;
+    wiegand_hub.mdev.fops = &wiegand_hub_misc_fops;
+
+    ret = misc_register(&wiegand_hub.mdev);
+    if (ret < 0) {
+        pr_err("%s: misc register failed.\n", __func__);
+        return ret;
+    }
+
+    return 0;
+}
+
+static void __exit wiegand_hub_exit(void)
+{
+    misc_deregister(&wiegand_hub.mdev);
+}
+
+module_init(wiegand_hub_init);
+module_exit(wiegand_hub_exit);
+
+MODULE_AUTHOR("ayst.shen@foxmail.com");
+MODULE_DESCRIPTION("Wiegand Hub");
+MODULE_VERSION("1.0");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2021 Bob Shen.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Kernel side of /dev/wiegand_hub: the wiegand_in and wiegand_out drivers
+ * register each port they probe, the hub reaches them through these.
+ */
+
+#ifndef _WIEGAND_HUB_H
+#define _WIEGAND_HUB_H
+
+#include <linux/errno.h>
+#include <linux/list.h>
+#include <linux/types.h>
+
+#include "wiegand_uapi.h"
+
+struct wiegand_hub_in {
+    int                     port;
+    /* The open hub is a user of the port, its interrupts run while attached */
+    void                    (*attach)(struct wiegand_hub_in *in);
+    void                    (*detach)(struct wiegand_hub_in *in);
+    struct list_head        node;
+};
+
+struct wiegand_hub_out {
+    int                     port;
+    /* Start data on the wire like WIEGAND_WRITE, -EAGAIN while a frame is on it */
+    int                     (*write)(struct wiegand_hub_out *out, u32 data);
+    bool                    (*busy)(struct wiegand_hub_out *out);
+    struct list_head        node;
+};
+
+#ifdef CONFIG_WIEGAND_HUB
+void wiegand_hub_add_in(struct wiegand_hub_in *in);
+void wiegand_hub_del_in(struct wiegand_hub_in *in);
+void wiegand_hub_add_out(struct wiegand_hub_out *out);
+void wiegand_hub_del_out(struct wiegand_hub_out *out);
+/* From the wiegand_in hrtimer, for every frame queued */
+void wiegand_hub_frame(const struct wiegand_frame *frame);
+/* From the wiegand_out hrtimer, once a port is idle again */
+void wiegand_hub_out_idle(void);
+/* Send data on a wiegand_out port, waits for it to be idle, so not in atomic context */
+int wiegand_hub_forward(int port, u32 data);
+#else
+static inline void wiegand_hub_add_in(struct wiegand_hub_in *in) { }
+static inline void wiegand_hub_del_in(struct wiegand_hub_in *in) { }
+static inline void wiegand_hub_add_out(struct wiegand_hub_out *out) { }
+static inline void wiegand_hub_del_out(struct wiegand_hub_out *out) { }
+static inline void wiegand_hub_frame(const struct wiegand_frame *frame) { }
+static inline void wiegand_hub_out_idle(void) { }
+static inline int wiegand_hub_forward(int port, u32 data) { return -ENODEV; }
+#endif
+
+#endif /* _WIEGAND_HUB_H */
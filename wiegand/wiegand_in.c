@@ -20,7 +20,6 @@
 #include <linux/delay.h>
 #include <linux/miscdevice.h>
 #include <linux/spinlock.h>
-#include <linux/wakelock.h>
 #include <linux/clk.h>
 #include <linux/syscalls.h>
 #include <linux/platform_device.h>
@@ -28,7 +27,9 @@
 #include <linux/gpio.h>
 #include <linux/spinlock.h>
 #include <linux/poll.h>
+#include <linux/uio.h>
 #include <linux/hrtimer.h>
+#include <linux/input.h>
 #include <linux/wait.h>
 #include <linux/time.h>
 #include <linux/kernel.h>
@@ -37,63 +38,347 @@
 #include <linux/of_irq.h>
 #include <linux/of_gpio.h>
 #include <linux/of_platform.h>
+#include <linux/bitops.h>
+#include <linux/kfifo.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/pm_wakeup.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/version.h>
+#include <linux/filter.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+
+#include "wiegand_uapi.h"
+#include "wiegand_hub.h"
+#include "wiegand_parity.h"
+
+#define CREATE_TRACE_POINTS
+#include "wiegand_in_trace.h"
 
 
 #define WIEGANDINDRV_LIB_VERSION    "1.0.0"
 
-#define WIEGAND_DEIVCE_NAME         "wiegand_in"
+#define WIEGAND_DEIVCE_NAME         WIEGAND_IN_DEVICE_NAME
 
-#define WIEGAND_MODE_26     26 //bit
-#define WIEGAND_MODE_34     34 //bit
+/* access_ok() lost its type argument in 5.0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#define wiegand_access_ok(addr, size)   access_ok(addr, size)
+#else
+#define wiegand_access_ok(addr, size)   access_ok(VERIFY_WRITE, addr, size)
+#endif
 
 #define DEF_PULSE_WIDTH     100 //us
 #define DEF_PULSE_INTERVAL  1000 //us
 #define DEF_DATA_LENGTH     WIEGAND_MODE_26
 #define DEVIATION           100 //us
 
-/* ioctl command */
-#define WIEGAND_IOC_MAGIC  'w'
+#define WIEGAND_FIFO_SIZE   16 //frames
+
+#define WIEGAND_PIN_DIGITS  8 //BCD digits in a u32
+
+#define WIEGAND_REDIRECT_SIZE   8 //frames waiting for their wiegand_out port
+
+#define WIEGAND_WAKEUP_HOLD_MS  1000 //awake after a frame, for its reader to run
+
+/* irq_set_affinity_hint() also moved the interrupt, 5.17 split the two */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+#define wiegand_irq_pin(irq, mask)  irq_set_affinity_and_hint(irq, mask)
+#define wiegand_irq_unpin(irq)      irq_update_affinity_hint(irq, NULL)
+#else
+#define wiegand_irq_pin(irq, mask)  irq_set_affinity_hint(irq, mask)
+#define wiegand_irq_unpin(irq)      irq_set_affinity_hint(irq, NULL)
+#endif
+
+/* BPF_PROG_RUN() became bpf_prog_run() in 5.15 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+#define wiegand_bpf_run(prog, ctx)  bpf_prog_run(prog, ctx)
+#else
+#define wiegand_bpf_run(prog, ctx)  BPF_PROG_RUN(prog, ctx)
+#endif
+
+/* Per-CPU counters, summed when read through sysfs */
+struct wiegand_in_stats {
+    u64                     irqs;
+    u64                     glitches;
+    u64                     gap_resets;
+    u64                     frames_ok;
+    u64                     length_errors;
+    u64                     parity_errors;
+    u64                     overruns;
+    u64                     line_faults;
+    u64                     keys;
+    /* WIEGAND_SET_FILTER actions other than deliver */
+    u64                     filter_drops;
+    u64                     filter_tags;
+    u64                     filter_redirects;
+    u64                     redirect_drops; /* redirect queue full */
+    /* frame window closed more than the tolerance late */
+    u64                     late_windows;
+    /* last edge to frame queued */
+    u64                     latency_sum_ns;
+    u64                     latency_min_ns;
+    u64                     latency_max_ns;
+    struct u64_stats_sync   syncp;
+};
 
-#define WIEGAND_PULSE_WIDTH     _IOW(WIEGAND_IOC_MAGIC, 1, int)
-#define WIEGAND_PULSE_INTERVAL  _IOW(WIEGAND_IOC_MAGIC, 2, int)
-#define WIEGAND_FORMAT          _IOW(WIEGAND_IOC_MAGIC, 3, int)
-#define WIEGAND_READ            _IOR(WIEGAND_IOC_MAGIC, 4, unsigned int)
-#define WIEGAND_WRITE           _IOW(WIEGAND_IOC_MAGIC, 5, unsigned char *)
-#define WIEGAND_STATUS          _IOR(WIEGAND_IOC_MAGIC, 6, int)
+/* Immutable once published, replaced as a whole under config_lock */
+struct wiegand_in_profile {
+    struct wiegand_config   cfg;
+    struct rcu_head         rcu;
+};
 
-#define WIEGAND_IOC_MAXNR 6
+/* Like the profile, run from the frame window hrtimer under RCU */
+struct wiegand_in_filter {
+    struct bpf_prog         *prog;
+    struct rcu_head         rcu;
+};
 
 struct wiegand_in_dev {
     struct platform_device  *platform_dev;
     struct device           *dev;
     struct miscdevice       mdev;
+    char                    name[16];
+    int                     port;
     int                     irq0;
     int                     irq1;
     unsigned int            data0_pin;
     unsigned int            data1_pin;
     unsigned int            current_data[2];
-    unsigned int            wiegand_in_data[2];
-    int                     data_length;
     int                     recvd_length;
-    int                     pulse_width;
-    int                     pulse_intval;
-    int                     error;
+    struct wiegand_in_profile __rcu *profile;
+    struct wiegand_in_filter __rcu *filter;   /* NULL delivers every frame */
+    struct mutex            config_lock;
+    struct wiegand_config   frame_cfg;    /* profile of the frame in progress */
+    u64                     last_edge_ns; /* last accepted edge */
+    bool                    line_fault;   /* a data line was still low after a frame */
+    bool                    wakeup;       /* wakeup-source, a swipe wakes the system */
+    bool                    suspended;    /* noirq phase, edges are only buffered */
+    int                     cpu;          /* wiegand,cpu, of the interrupts and window, -1 any */
+    DECLARE_KFIFO(frames, struct wiegand_frame, WIEGAND_FIFO_SIZE);
     spinlock_t              lock;
-    int                     use_count;
+    int                     use_count;      /* the node, frames are queued while open */
+    /* Open and hub attach, the interrupts run while either holds the port */
+    struct mutex            users_lock;
+    bool                    hub_attached;
+    bool                    input_open;   /* the input device has evdev users */
+    struct wiegand_hub_in   hub;
     struct hrtimer          timer;
     wait_queue_head_t       wq;
-    struct timeval          latest;
-    struct timeval          now;
+    /* WIEGAND_SET_COALESCE of the open file, the rest is under lock */
+    struct wiegand_coalesce coalesce;
+    bool                    readable;       /* readers were woken for the queued frames */
+    bool                    coalesce_armed;
+    struct hrtimer          coalesce_timer; /* usecs after the oldest unannounced frame */
+    struct wiegand_in_stats __percpu *stats;
+    struct input_dev        *input; /* optional, wiegand,input-device */
+    /* wiegand,keypad: 4 and 8 bit bursts are key presses */
+    bool                    keypad;
+    int                     pin_terminator; /* WIEGAND_KEY_*, -1 to not assemble PINs */
+    u32                     pin_timeout_ms;
+    u32                     pin;            /* BCD, last digit in the low nibble */
+    int                     pin_digits;
+    u64                     pin_last_ns;
+    /*
+     * WIEGAND_FILTER_REDIRECT frames, sent from process context. Forwarding
+     * waits for the wiegand_out port, so not on the system workqueue.
+     */
+    DECLARE_KFIFO(redirects, struct wiegand_hub_write, WIEGAND_REDIRECT_SIZE);
+    struct workqueue_struct *redirect_wq;
+    struct work_struct      redirect_work;
+    /* Lines on a chip that sleeps, like gpio-sim, are read by lines_work */
+    bool                    cansleep;
+    struct work_struct      lines_work;
 };
 
+/*
+ * Only called from the edge interrupt and the frame window hrtimer, which
+ * never nest, so a plain per-CPU update is enough.
+ */
+#define wiegand_in_stats_inc(wiegand_in, field) do {                        \
+        struct wiegand_in_stats *__st = this_cpu_ptr((wiegand_in)->stats);  \
+        u64_stats_update_begin(&__st->syncp);                               \
+        __st->field++;                                                      \
+        u64_stats_update_end(&__st->syncp);                                 \
+    } while (0)
+
+static void wiegand_in_stats_frame(struct wiegand_in_dev *wiegand_in,
+                                   const struct wiegand_frame *frame, u64 latency_ns)
+{
+    struct wiegand_in_stats *st = this_cpu_ptr(wiegand_in->stats);
+
+    u64_stats_update_begin(&st->syncp);
+    if (frame->status == WIEGAND_FRAME_OK) {
+        st->frames_ok++;
+    } else if (frame->status == WIEGAND_FRAME_KEY || frame->status == WIEGAND_FRAME_PIN) {
+        st->keys++;
+    } else if (frame->status == WIEGAND_FRAME_PARITY_ERROR) {
+        st->parity_errors++;
+    } else {
+        st->length_errors++;
+    }
+    st->latency_sum_ns += latency_ns;
+    if (latency_ns < st->latency_min_ns) {
+        st->latency_min_ns = latency_ns;
+    }
+    if (latency_ns > st->latency_max_ns) {
+        st->latency_max_ns = latency_ns;
+    }
+    u64_stats_update_end(&st->syncp);
+}
+
+static void wiegand_in_stats_read(struct wiegand_in_dev *wiegand_in, struct wiegand_in_stats *total)
+{
+    int cpu;
+
+    memset(total, 0, sizeof(*total));
+    total->latency_min_ns = U64_MAX;
+
+    for_each_possible_cpu(cpu) {
+        struct wiegand_in_stats *st = per_cpu_ptr(wiegand_in->stats, cpu);
+        struct wiegand_in_stats snap;
+        unsigned int start;
+
+        do {
+            start = u64_stats_fetch_begin(&st->syncp);
+            memcpy(&snap, st, offsetof(struct wiegand_in_stats, syncp));
+        } while (u64_stats_fetch_retry(&st->syncp, start));
+
+        total->irqs += snap.irqs;
+        total->glitches += snap.glitches;
+        total->gap_resets += snap.gap_resets;
+        total->frames_ok += snap.frames_ok;
+        total->length_errors += snap.length_errors;
+        total->parity_errors += snap.parity_errors;
+        total->overruns += snap.overruns;
+        total->line_faults += snap.line_faults;
+        total->keys += snap.keys;
+        total->filter_drops += snap.filter_drops;
+        total->filter_tags += snap.filter_tags;
+        total->filter_redirects += snap.filter_redirects;
+        total->redirect_drops += snap.redirect_drops;
+        total->late_windows += snap.late_windows;
+        total->latency_sum_ns += snap.latency_sum_ns;
+        total->latency_min_ns = min(total->latency_min_ns, snap.latency_min_ns);
+        total->latency_max_ns = max(total->latency_max_ns, snap.latency_max_ns);
+    }
+
+    if (total->latency_min_ns == U64_MAX) {
+        total->latency_min_ns = 0;
+    }
+}
+
 static void wiegand_in_data_reset(struct wiegand_in_dev *wiegand_in)
 {
     wiegand_in->recvd_length = -1;
     wiegand_in->current_data[0] = 0;
     wiegand_in->current_data[1] = 0;
-    wiegand_in->wiegand_in_data[0] = 0;
-    wiegand_in->wiegand_in_data[1] = 0;
-    wiegand_in->error = 0;
+}
+
+/*
+ * Called with lock held. Readers stay woken until they drained the fifo,
+ * then wait for the next coalesce.frames frames or coalesce.usecs.
+ */
+static void wiegand_in_update_readable(struct wiegand_in_dev *wiegand_in)
+{
+    unsigned int len = kfifo_len(&wiegand_in->frames);
+
+    if (len == 0) {
+        wiegand_in->readable = false;
+    } else if (!wiegand_in->readable && len >= wiegand_in->coalesce.frames) {
+        wiegand_in->readable = true;
+        /* A running callback waits for the lock and clears coalesce_armed itself */
+        if (wiegand_in->coalesce_armed && hrtimer_try_to_cancel(&wiegand_in->coalesce_timer) >= 0) {
+            wiegand_in->coalesce_armed = false;
+        }
+        wake_up_interruptible(&wiegand_in->wq);
+    } else if (!wiegand_in->readable && !wiegand_in->coalesce_armed) {
+        wiegand_in->coalesce_armed = true;
+        hrtimer_start(&wiegand_in->coalesce_timer,
+                      ns_to_ktime((u64)wiegand_in->coalesce.usecs * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+    }
+}
+
+static enum hrtimer_restart wiegand_in_coalesce_timeout(struct hrtimer *timer)
+{
+    struct wiegand_in_dev *wiegand_in = container_of(timer, struct wiegand_in_dev, coalesce_timer);
+    unsigned long flags;
+
+    spin_lock_irqsave(&wiegand_in->lock, flags);
+    wiegand_in->coalesce_armed = false;
+    if (!wiegand_in->readable && !kfifo_is_empty(&wiegand_in->frames)) {
+        wiegand_in->readable = true;
+        wake_up_interruptible(&wiegand_in->wq);
+    }
+    spin_unlock_irqrestore(&wiegand_in->lock, flags);
+    return HRTIMER_NORESTART;
+}
+
+static bool wiegand_in_get_frame(struct wiegand_in_dev *wiegand_in, struct wiegand_frame *frame)
+{
+    unsigned long flags;
+    unsigned int n;
+
+    spin_lock_irqsave(&wiegand_in->lock, flags);
+    n = kfifo_out(&wiegand_in->frames, frame, 1);
+    if (n == 1 && kfifo_is_empty(&wiegand_in->frames)) {
+        wiegand_in->readable = false;
+    }
+    spin_unlock_irqrestore(&wiegand_in->lock, flags);
+
+    if (n != 1) {
+        return false;
+    }
+    trace_wiegand_in_frame_read(frame);
+    return true;
+}
+
+/* Wait for the readers' wakeup unless nonblock, the hrtimers are the only producers */
+static int wiegand_in_next_frame(struct wiegand_in_dev *wiegand_in, struct wiegand_frame *frame,
+                                 bool nonblock)
+{
+    for (;;) {
+        if ((nonblock || READ_ONCE(wiegand_in->readable)) && wiegand_in_get_frame(wiegand_in, frame)) {
+            return 0;
+        }
+        if (nonblock) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(wiegand_in->wq, READ_ONCE(wiegand_in->readable))) {
+            return -ERESTARTSYS;
+        }
+    }
+}
+
+static bool wiegand_in_coalesce_valid(const struct wiegand_coalesce *coalesce)
+{
+    return coalesce->frames >= 1 && coalesce->frames <= WIEGAND_FIFO_SIZE &&
+           coalesce->usecs <= USEC_PER_SEC && (coalesce->frames == 1 || coalesce->usecs > 0);
+}
+
+/* The node, the hub and the input device each hold the interrupts, under users_lock */
+static bool wiegand_in_in_use(struct wiegand_in_dev *wiegand_in)
+{
+    return wiegand_in->use_count > 0 || wiegand_in->hub_attached || wiegand_in->input_open;
+}
+
+/* Called with users_lock held by the first user of the port */
+static void wiegand_in_start(struct wiegand_in_dev *wiegand_in)
+{
+    wiegand_in_data_reset(wiegand_in);
+    wiegand_in->line_fault = false;
+    wiegand_in->pin_digits = 0;
+    enable_irq(gpio_to_irq(wiegand_in->data0_pin));
+    enable_irq(gpio_to_irq(wiegand_in->data1_pin));
+}
+
+/* Called with users_lock held by the last user */
+static void wiegand_in_stop(struct wiegand_in_dev *wiegand_in)
+{
+    disable_irq(gpio_to_irq(wiegand_in->data0_pin));
+    disable_irq(gpio_to_irq(wiegand_in->data1_pin));
 }
 
 static int wiegand_in_open(struct inode *inode, struct file *filp)
@@ -101,17 +386,25 @@ static int wiegand_in_open(struct inode *inode, struct file *filp)
     struct miscdevice *dev = filp->private_data;
     struct wiegand_in_dev *wiegand_in = container_of(dev, struct wiegand_in_dev, mdev);
 
-    spin_lock(&wiegand_in->lock);
+    mutex_lock(&wiegand_in->users_lock);
+    /* Irq safe, the hrtimers take it too */
+    spin_lock_irq(&wiegand_in->lock);
     if (wiegand_in->use_count > 0) {
-        spin_unlock(&wiegand_in->lock);
+        spin_unlock_irq(&wiegand_in->lock);
+        mutex_unlock(&wiegand_in->users_lock);
         return -EBUSY;
     }
     wiegand_in->use_count++;
-    spin_unlock(&wiegand_in->lock);
-
-    wiegand_in_data_reset(wiegand_in);
-    enable_irq(gpio_to_irq(wiegand_in->data0_pin));
-    enable_irq(gpio_to_irq(wiegand_in->data1_pin));
+    kfifo_reset(&wiegand_in->frames);
+    wiegand_in->readable = false;
+    wiegand_in->coalesce.frames = 1;
+    wiegand_in->coalesce.usecs = 0;
+    spin_unlock_irq(&wiegand_in->lock);
+
+    if (!wiegand_in->hub_attached && !wiegand_in->input_open) {
+        wiegand_in_start(wiegand_in);
+    }
+    mutex_unlock(&wiegand_in->users_lock);
     return 0;
 }
 
@@ -120,41 +413,81 @@ static int wiegand_in_release(struct inode *inode, struct file *filp)
     struct miscdevice *dev = filp->private_data;
     struct wiegand_in_dev *wiegand_in = container_of(dev, struct wiegand_in_dev, mdev);
 
-    disable_irq(gpio_to_irq(wiegand_in->data0_pin));
-    disable_irq(gpio_to_irq(wiegand_in->data1_pin));
-    spin_lock(&wiegand_in->lock);
+    mutex_lock(&wiegand_in->users_lock);
+    if (!wiegand_in->hub_attached && !wiegand_in->input_open) {
+        wiegand_in_stop(wiegand_in);
+    }
+    spin_lock_irq(&wiegand_in->lock);
     wiegand_in->use_count--;
-    spin_unlock(&wiegand_in->lock);
+    spin_unlock_irq(&wiegand_in->lock);
+    /* Nothing queues for the node anymore, so nothing rearms it */
+    hrtimer_cancel(&wiegand_in->coalesce_timer);
+    wiegand_in->coalesce_armed = false;
+    mutex_unlock(&wiegand_in->users_lock);
 
     return 0;
 }
 
-static ssize_t wiegand_in_read(struct file *filp, char *buf, size_t size, loff_t *l)
+static void wiegand_in_hub_attach(struct wiegand_hub_in *hub)
 {
-    struct miscdevice *dev = filp->private_data;
+    struct wiegand_in_dev *wiegand_in = container_of(hub, struct wiegand_in_dev, hub);
+
+    mutex_lock(&wiegand_in->users_lock);
+    if (!wiegand_in_in_use(wiegand_in)) {
+        wiegand_in_start(wiegand_in);
+    }
+    wiegand_in->hub_attached = true;
+    mutex_unlock(&wiegand_in->users_lock);
+}
+
+static void wiegand_in_hub_detach(struct wiegand_hub_in *hub)
+{
+    struct wiegand_in_dev *wiegand_in = container_of(hub, struct wiegand_in_dev, hub);
+
+    mutex_lock(&wiegand_in->users_lock);
+    wiegand_in->hub_attached = false;
+    if (!wiegand_in_in_use(wiegand_in)) {
+        wiegand_in_stop(wiegand_in);
+    }
+    mutex_unlock(&wiegand_in->users_lock);
+}
+
+static bool wiegand_in_nonblock(struct kiocb *iocb)
+{
+#ifdef IOCB_NOWAIT
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        return true;
+    }
+#endif
+    return iocb->ki_filp->f_flags & O_NONBLOCK;
+}
+
+/* One frame per read, so read(2), aio and io_uring all see the same records */
+static ssize_t wiegand_in_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct miscdevice *dev = iocb->ki_filp->private_data;
     struct wiegand_in_dev *wiegand_in = container_of(dev, struct wiegand_in_dev, mdev);
+    struct wiegand_frame frame;
+    int ret;
 
-    if (filp->f_flags & O_NONBLOCK) {
-        return -EAGAIN;
+    if (iov_iter_count(to) < sizeof(frame.raw)) {
+        return -EINVAL;
     }
 
-    if (wait_event_interruptible(wiegand_in->wq,
-                                 (wiegand_in->wiegand_in_data[0] > 0) || (wiegand_in->error))) {
-        return -ERESTARTSYS;
+    ret = wiegand_in_next_frame(wiegand_in, &frame, wiegand_in_nonblock(iocb));
+    if (ret) {
+        return ret;
     }
 
-    if (wiegand_in->wiegand_in_data[0] > 0) {
-        printk("wiegand_in_read: %d, %d\n", wiegand_in->wiegand_in_data[0], wiegand_in->wiegand_in_data[1]);
-        if (copy_to_user(buf, wiegand_in->wiegand_in_data,
-                         sizeof(wiegand_in->wiegand_in_data))) {
+    /* A frame of the wrong length reads as 0 bytes */
+    if (frame.status != WIEGAND_FRAME_LENGTH_ERROR) {
+        dev_dbg(wiegand_in->dev, "%s: %08x%08x\n", __func__, frame.raw[1], frame.raw[0]);
+        if (copy_to_iter(frame.raw, sizeof(frame.raw), to) != sizeof(frame.raw)) {
             return -EFAULT;
         }
-        wiegand_in->wiegand_in_data[0] = 0;
-        wiegand_in->wiegand_in_data[1] = 0;
 
-        return sizeof(wiegand_in->wiegand_in_data);
+        return sizeof(frame.raw);
     }
-    wiegand_in->error = 0;
 
     return 0;
 }
@@ -167,24 +500,294 @@ static unsigned int wiegand_in_poll(struct file *filp, poll_table *wait)
     struct wiegand_in_dev *wiegand_in = container_of(dev, struct wiegand_in_dev, mdev);
     poll_wait(filp, &wiegand_in->wq, wait);
 
-    if (wiegand_in->wiegand_in_data[0]) {
+    if (READ_ONCE(wiegand_in->readable)) {
         mask |= POLLIN | POLLRDNORM;
     }
+    if (READ_ONCE(wiegand_in->line_fault)) {
+        mask |= POLLERR;
+    }
 
     return mask;
 }
 
-static unsigned int wiegand_in_rm_parity_bits(struct wiegand_in_dev *wiegand_in) {
+static u64 wiegand_in_raw(const struct wiegand_frame *frame)
+{
+    return ((u64)frame->raw[1] << 32) | frame->raw[0];
+}
+
+static unsigned int wiegand_in_rm_parity_bits(struct wiegand_frame *frame) {
     unsigned int data = 0;
-    if (wiegand_in->data_length == WIEGAND_MODE_26) {
-        data = (wiegand_in->wiegand_in_data[0] >> 1) & 0xffffff;
-    } else if (wiegand_in->data_length == WIEGAND_MODE_34) {
-        data = wiegand_in->wiegand_in_data[1] & 0x00000001;
-        data = (data << 31) | ((wiegand_in->wiegand_in_data[0] >> 1) & 0x7fffffff);
+    if (frame->bits == WIEGAND_MODE_26 || frame->bits == WIEGAND_MODE_34) {
+        data = wiegand_parity_strip(wiegand_in_raw(frame), frame->bits);
     }
     return data;
 }
 
+/* See wiegand_parity.h, wiegand_out sends the same parity bits */
+static int wiegand_in_check_parity(struct wiegand_frame *frame)
+{
+    if (!wiegand_parity_length_valid(frame->bits)) {
+        return WIEGAND_FRAME_LENGTH_ERROR;
+    }
+    if (wiegand_parity_check(wiegand_in_raw(frame), frame->bits)) {
+        return WIEGAND_FRAME_PARITY_ERROR;
+    }
+    return WIEGAND_FRAME_OK;
+}
+
+static long wiegand_in_read_frames(struct wiegand_in_dev *wiegand_in, struct file *filp,
+                                   unsigned long arg)
+{
+    struct wiegand_frames req;
+    struct wiegand_frame frame;
+    struct wiegand_frame __user *frames;
+    long n = 0;
+    int ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (req.flags || !req.count) {
+        return -EINVAL;
+    }
+    frames = (struct wiegand_frame __user *)(uintptr_t)req.frames;
+
+    ret = wiegand_in_next_frame(wiegand_in, &frame, filp->f_flags & O_NONBLOCK);
+    if (ret) {
+        return ret;
+    }
+
+    do {
+        if (copy_to_user(&frames[n], &frame, sizeof(frame))) {
+            return n ? n : -EFAULT;
+        }
+        n++;
+    } while (n < req.count && wiegand_in_get_frame(wiegand_in, &frame));
+
+    return n;
+}
+
+static bool wiegand_in_config_valid(const struct wiegand_config *cfg)
+{
+    return cfg->format >= 1 && cfg->format <= 64 &&
+           cfg->pulse_width > 0 && cfg->pulse_width <= USEC_PER_SEC &&
+           cfg->pulse_intval > 0 && cfg->pulse_intval <= USEC_PER_SEC;
+}
+
+static void wiegand_in_config_get(struct wiegand_in_dev *wiegand_in, struct wiegand_config *cfg)
+{
+    rcu_read_lock();
+    *cfg = rcu_dereference(wiegand_in->profile)->cfg;
+    rcu_read_unlock();
+}
+
+/*
+ * Replace the profile with a copy of cfg, called with config_lock held.
+ * Readers only ever see a complete profile, the interrupt picks it up at
+ * the start of the next frame.
+ */
+static int wiegand_in_config_publish(struct wiegand_in_dev *wiegand_in,
+                                     const struct wiegand_config *cfg)
+{
+    struct wiegand_in_profile *profile, *old;
+
+    if (!wiegand_in_config_valid(cfg)) {
+        return -EINVAL;
+    }
+    profile = kmalloc(sizeof(*profile), GFP_KERNEL);
+    if (!profile) {
+        return -ENOMEM;
+    }
+    profile->cfg = *cfg;
+
+    old = rcu_dereference_protected(wiegand_in->profile,
+                                    lockdep_is_held(&wiegand_in->config_lock));
+    rcu_assign_pointer(wiegand_in->profile, profile);
+    if (old) {
+        kfree_rcu(old, rcu);
+    }
+    return 0;
+}
+
+/* Update the __u32 at offset in struct wiegand_config, keeping the others */
+static int wiegand_in_config_field(struct wiegand_in_dev *wiegand_in, size_t offset, u32 value)
+{
+    struct wiegand_config cfg;
+    int ret;
+
+    mutex_lock(&wiegand_in->config_lock);
+    cfg = rcu_dereference_protected(wiegand_in->profile,
+                                    lockdep_is_held(&wiegand_in->config_lock))->cfg;
+    *(u32 *)((char *)&cfg + offset) = value;
+    ret = wiegand_in_config_publish(wiegand_in, &cfg);
+    mutex_unlock(&wiegand_in->config_lock);
+    return ret;
+}
+
+#ifdef CONFIG_WIEGAND_FILTER
+/*
+ * Like seccomp_check_filter(): loads are 32 bit and absolute within
+ * struct wiegand_filter_data, rewritten to loads from the context, and
+ * the rest is plain arithmetic, jumps and scratch memory.
+ */
+static int wiegand_in_filter_check(struct sock_filter *filter, unsigned int flen)
+{
+    unsigned int pc;
+
+    for (pc = 0; pc < flen; pc++) {
+        struct sock_filter *ftest = &filter[pc];
+        u32 k = ftest->k;
+
+        switch (ftest->code) {
+        case BPF_LD | BPF_W | BPF_ABS:
+            ftest->code = BPF_LDX | BPF_W | BPF_ABS;
+            if (k >= sizeof(struct wiegand_filter_data) || k & 3) {
+                return -EINVAL;
+            }
+            continue;
+        case BPF_LD | BPF_W | BPF_LEN:
+            ftest->code = BPF_LD | BPF_IMM;
+            ftest->k = sizeof(struct wiegand_filter_data);
+            continue;
+        case BPF_LDX | BPF_W | BPF_LEN:
+            ftest->code = BPF_LDX | BPF_IMM;
+            ftest->k = sizeof(struct wiegand_filter_data);
+            continue;
+        case BPF_RET | BPF_K:
+        case BPF_RET | BPF_A:
+        case BPF_ALU | BPF_ADD | BPF_K:
+        case BPF_ALU | BPF_ADD | BPF_X:
+        case BPF_ALU | BPF_SUB | BPF_K:
+        case BPF_ALU | BPF_SUB | BPF_X:
+        case BPF_ALU | BPF_MUL | BPF_K:
+        case BPF_ALU | BPF_MUL | BPF_X:
+        case BPF_ALU | BPF_DIV | BPF_K:
+        case BPF_ALU | BPF_DIV | BPF_X:
+        case BPF_ALU | BPF_AND | BPF_K:
+        case BPF_ALU | BPF_AND | BPF_X:
+        case BPF_ALU | BPF_OR | BPF_K:
+        case BPF_ALU | BPF_OR | BPF_X:
+        case BPF_ALU | BPF_XOR | BPF_K:
+        case BPF_ALU | BPF_XOR | BPF_X:
+        case BPF_ALU | BPF_LSH | BPF_K:
+        case BPF_ALU | BPF_LSH | BPF_X:
+        case BPF_ALU | BPF_RSH | BPF_K:
+        case BPF_ALU | BPF_RSH | BPF_X:
+        case BPF_ALU | BPF_NEG:
+        case BPF_LD | BPF_IMM:
+        case BPF_LDX | BPF_IMM:
+        case BPF_MISC | BPF_TAX:
+        case BPF_MISC | BPF_TXA:
+        case BPF_LD | BPF_MEM:
+        case BPF_LDX | BPF_MEM:
+        case BPF_ST:
+        case BPF_STX:
+        case BPF_JMP | BPF_JA:
+        case BPF_JMP | BPF_JEQ | BPF_K:
+        case BPF_JMP | BPF_JEQ | BPF_X:
+        case BPF_JMP | BPF_JGE | BPF_K:
+        case BPF_JMP | BPF_JGE | BPF_X:
+        case BPF_JMP | BPF_JGT | BPF_K:
+        case BPF_JMP | BPF_JGT | BPF_X:
+        case BPF_JMP | BPF_JSET | BPF_K:
+        case BPF_JMP | BPF_JSET | BPF_X:
+            continue;
+        default:
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static void wiegand_in_filter_free(struct wiegand_in_filter *filter)
+{
+    if (filter) {
+        bpf_prog_destroy(filter->prog);
+        kfree(filter);
+    }
+}
+
+static void wiegand_in_filter_free_rcu(struct rcu_head *rcu)
+{
+    wiegand_in_filter_free(container_of(rcu, struct wiegand_in_filter, rcu));
+}
+
+/* Checked and converted here, so the hrtimer only ever runs a valid program */
+static int wiegand_in_set_filter(struct wiegand_in_dev *wiegand_in, unsigned long arg)
+{
+    struct wiegand_filter req;
+    struct wiegand_in_filter *filter = NULL, *old;
+    struct sock_fprog fprog;
+    int ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (req.flags || req.len > BPF_MAXINSNS) {
+        return -EINVAL;
+    }
+
+    if (req.len) {
+        filter = kzalloc(sizeof(*filter), GFP_KERNEL);
+        if (!filter) {
+            return -ENOMEM;
+        }
+        fprog.len = req.len;
+        fprog.filter = (struct sock_filter __user *)(uintptr_t)req.filter;
+        ret = bpf_prog_create_from_user(&filter->prog, &fprog, wiegand_in_filter_check, false);
+        if (ret) {
+            kfree(filter);
+            return ret;
+        }
+    }
+    dev_info(wiegand_in->dev, "%s: WIEGAND_SET_FILTER len=%u\n", __func__, req.len);
+
+    mutex_lock(&wiegand_in->config_lock);
+    old = rcu_dereference_protected(wiegand_in->filter,
+                                    lockdep_is_held(&wiegand_in->config_lock));
+    rcu_assign_pointer(wiegand_in->filter, filter);
+    mutex_unlock(&wiegand_in->config_lock);
+    if (old) {
+        call_rcu(&old->rcu, wiegand_in_filter_free_rcu);
+    }
+    return 0;
+}
+
+/* Returns the WIEGAND_FILTER_* for frame, deliver without a filter */
+static u32 wiegand_in_filter_run(struct wiegand_in_dev *wiegand_in, const struct wiegand_frame *frame)
+{
+    struct wiegand_in_filter *filter;
+    struct wiegand_filter_data data;
+    u32 action = WIEGAND_FILTER_DELIVER;
+
+    rcu_read_lock();
+    filter = rcu_dereference(wiegand_in->filter);
+    if (filter) {
+        data.data = frame->data;
+        data.raw[0] = frame->raw[0];
+        data.raw[1] = frame->raw[1];
+        data.bits = frame->bits;
+        data.status = frame->status;
+        data.port = frame->port;
+        data.timestamp_ns = frame->timestamp_ns;
+        action = wiegand_bpf_run(filter->prog, &data);
+    }
+    rcu_read_unlock();
+    return action;
+}
+#else
+static inline void wiegand_in_filter_free(struct wiegand_in_filter *filter) {}
+static inline int wiegand_in_set_filter(struct wiegand_in_dev *wiegand_in, unsigned long arg)
+{
+    return -EOPNOTSUPP;
+}
+static inline u32 wiegand_in_filter_run(struct wiegand_in_dev *wiegand_in,
+                                        const struct wiegand_frame *frame)
+{
+    return WIEGAND_FILTER_DELIVER;
+}
+#endif
+
 static long wiegand_in_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct miscdevice *dev = filp->private_data;
@@ -201,10 +804,8 @@ static long wiegand_in_ioctl(struct file *filp, unsigned int cmd, unsigned long
         return -EINVAL;
     }
 
-    if (_IOC_DIR(cmd) & _IOC_READ) {
-        ret = !access_ok(VERIFY_WRITE, (void *)arg, _IOC_SIZE(cmd));
-    } else if (_IOC_DIR(cmd) & _IOC_WRITE) {
-        ret = !access_ok(VERIFY_READ, (void *)arg, _IOC_SIZE(cmd));
+    if (_IOC_DIR(cmd) & (_IOC_READ | _IOC_WRITE)) {
+        ret = !wiegand_access_ok((void __user *)arg, _IOC_SIZE(cmd));
     }
     if (ret) {
         dev_err(wiegand_in->dev, "%s, verify r/w failed.", __func__);
@@ -216,57 +817,126 @@ static long wiegand_in_ioctl(struct file *filp, unsigned int cmd, unsigned long
                 if (get_user(cs, (unsigned int *)arg)) {
                     return -EINVAL;
                 }
-                wiegand_in->pulse_width = cs;
                 dev_info(wiegand_in->dev, "%s: WIEGAND_PULSE_WIDTH pulse_width=%d\n", 
-                    __func__, wiegand_in->pulse_width);
-                break;
+                    __func__, cs);
+                return wiegand_in_config_field(wiegand_in,
+                                               offsetof(struct wiegand_config, pulse_width), cs);
             }
 
         case WIEGAND_PULSE_INTERVAL: {
                 if (get_user(cs, (unsigned int *)arg)) {
                     return -EINVAL;
                 }
-                wiegand_in->pulse_intval = cs;
                 dev_info(wiegand_in->dev, "%s: WIEGAND_PULSE_INTERVAL pulse_intval=%d\n", 
-                    __func__, wiegand_in->pulse_intval);
-                break;
+                    __func__, cs);
+                return wiegand_in_config_field(wiegand_in,
+                                               offsetof(struct wiegand_config, pulse_intval), cs);
             }
 
         case WIEGAND_FORMAT: {
                 if (get_user(cs, (unsigned int *)arg)) {
                     return -EINVAL;
                 }
-                wiegand_in->data_length = cs;
                 dev_info(wiegand_in->dev, "%s: WIEGAND_FORMAT data_length=%d\n", 
-                    __func__, wiegand_in->data_length);
+                    __func__, cs);
+                return wiegand_in_config_field(wiegand_in,
+                                               offsetof(struct wiegand_config, format), cs);
+            }
+
+        case WIEGAND_GET_CONFIG: {
+                struct wiegand_config cfg;
+
+                wiegand_in_config_get(wiegand_in, &cfg);
+                if (copy_to_user((void __user *)arg, &cfg, sizeof(cfg))) {
+                    return -EFAULT;
+                }
                 break;
             }
 
+        case WIEGAND_SET_CONFIG: {
+                struct wiegand_config cfg;
+
+                if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg))) {
+                    return -EFAULT;
+                }
+                mutex_lock(&wiegand_in->config_lock);
+                ret = wiegand_in_config_publish(wiegand_in, &cfg);
+                mutex_unlock(&wiegand_in->config_lock);
+                return ret;
+            }
+
+        case WIEGAND_GET_COALESCE: {
+                struct wiegand_coalesce coalesce;
+
+                spin_lock_irq(&wiegand_in->lock);
+                coalesce = wiegand_in->coalesce;
+                spin_unlock_irq(&wiegand_in->lock);
+                if (copy_to_user((void __user *)arg, &coalesce, sizeof(coalesce))) {
+                    return -EFAULT;
+                }
+                break;
+            }
+
+        case WIEGAND_SET_COALESCE: {
+                struct wiegand_coalesce coalesce;
+
+                if (copy_from_user(&coalesce, (void __user *)arg, sizeof(coalesce))) {
+                    return -EFAULT;
+                }
+                if (!wiegand_in_coalesce_valid(&coalesce)) {
+                    return -EINVAL;
+                }
+                dev_dbg(wiegand_in->dev, "%s: WIEGAND_SET_COALESCE frames=%u usecs=%u\n",
+                        __func__, coalesce.frames, coalesce.usecs);
+                /* An armed timer keeps its old expiry, the next one uses the new usecs */
+                spin_lock_irq(&wiegand_in->lock);
+                wiegand_in->coalesce = coalesce;
+                wiegand_in_update_readable(wiegand_in);
+                spin_unlock_irq(&wiegand_in->lock);
+                break;
+            }
+
+        case WIEGAND_SET_FILTER:
+            return wiegand_in_set_filter(wiegand_in, arg);
+
         case WIEGAND_READ: {
-                if (wait_event_interruptible(wiegand_in->wq,
-                                             (wiegand_in->wiegand_in_data[0] > 0) 
-                                             || (wiegand_in->error))) {
-                    return -ERESTARTSYS;
+                struct wiegand_frame frame;
+
+                ret = wiegand_in_next_frame(wiegand_in, &frame, filp->f_flags & O_NONBLOCK);
+                if (ret) {
+                    return ret;
                 }
-                data = wiegand_in_rm_parity_bits(wiegand_in);
+                data = (frame.status == WIEGAND_FRAME_LENGTH_ERROR) ? 0 : frame.data;
                 if (copy_to_user((int *)arg, &data, sizeof(int))) {
                     return -EFAULT;
                 }
-                
-                dev_info(wiegand_in->dev, "%s: WIEGAND_READ[%d] buf:%08x%08x data:%08x\n", __func__,
-                            wiegand_in->data_length,
-                            wiegand_in->wiegand_in_data[0],
-                            wiegand_in->wiegand_in_data[1],
+
+                dev_dbg(wiegand_in->dev, "%s: WIEGAND_READ[%d] buf:%08x%08x data:%08x\n", __func__,
+                            frame.bits,
+                            frame.raw[0],
+                            frame.raw[1],
                             data);
+                break;
+            }
 
-                wiegand_in->error = 0;
-                wiegand_in->wiegand_in_data[0] = 0;
-                wiegand_in->wiegand_in_data[1] = 0;
+        case WIEGAND_READ_FRAME: {
+                struct wiegand_frame frame;
+
+                ret = wiegand_in_next_frame(wiegand_in, &frame, filp->f_flags & O_NONBLOCK);
+                if (ret) {
+                    return ret;
+                }
+                if (copy_to_user((void __user *)arg, &frame, sizeof(frame))) {
+                    return -EFAULT;
+                }
                 break;
             }
 
+        case WIEGAND_READ_FRAMES:
+            return wiegand_in_read_frames(wiegand_in, filp, arg);
+
         case WIEGAND_STATUS: {
-                if (wiegand_in->wiegand_in_data[0] == 0) {
+                if (kfifo_is_empty(&wiegand_in->frames)) {
                     cs = 0;
                 } else {
                     cs = 1;
@@ -274,11 +944,18 @@ static long wiegand_in_ioctl(struct file *filp, unsigned int cmd, unsigned long
                 if (put_user(cs, (unsigned int *)arg)) {
                     return -EINVAL;
                 }
-                dev_info(wiegand_in->dev, "%s: WIEGAND_STATUS status=%d\n", 
+                dev_dbg(wiegand_in->dev, "%s: WIEGAND_STATUS status=%d\n", 
                     __func__, cs);
                 break;
             }
 
+        case WIEGAND_GET_VERSION: {
+                if (put_user(WIEGAND_UAPI_VERSION, (__u32 *)arg)) {
+                    return -EFAULT;
+                }
+                break;
+            }
+
         default:
             return -EINVAL;
     }
@@ -289,64 +966,544 @@ static long wiegand_in_ioctl(struct file *filp, unsigned int cmd, unsigned long
 static struct file_operations wiegand_in_misc_fops = {
     .open       = wiegand_in_open,
     .release    = wiegand_in_release,
-    .read       = wiegand_in_read,
+    .read_iter  = wiegand_in_read_iter,
     .unlocked_ioctl = wiegand_in_ioctl,
     .poll       = wiegand_in_poll,
 };
 
-static void wiegand_in_check_data(struct wiegand_in_dev *wiegand_in)
+static struct wiegand_in_dev *wiegand_in_from_device(struct device *dev)
+{
+    struct miscdevice *mdev = dev_get_drvdata(dev);
+
+    return container_of(mdev, struct wiegand_in_dev, mdev);
+}
+
+#define WIEGAND_IN_STAT_ATTR(field)                                          \
+static ssize_t field##_show(struct device *dev,                              \
+                            struct device_attribute *attr, char *buf)        \
+{                                                                            \
+    struct wiegand_in_stats total;                                           \
+                                                                             \
+    wiegand_in_stats_read(wiegand_in_from_device(dev), &total);              \
+    return sprintf(buf, "%llu\n", total.field);                              \
+}                                                                            \
+static DEVICE_ATTR_RO(field)
+
+WIEGAND_IN_STAT_ATTR(irqs);
+WIEGAND_IN_STAT_ATTR(glitches);
+WIEGAND_IN_STAT_ATTR(gap_resets);
+WIEGAND_IN_STAT_ATTR(frames_ok);
+WIEGAND_IN_STAT_ATTR(length_errors);
+WIEGAND_IN_STAT_ATTR(parity_errors);
+WIEGAND_IN_STAT_ATTR(overruns);
+WIEGAND_IN_STAT_ATTR(line_faults);
+WIEGAND_IN_STAT_ATTR(keys);
+WIEGAND_IN_STAT_ATTR(filter_drops);
+WIEGAND_IN_STAT_ATTR(filter_tags);
+WIEGAND_IN_STAT_ATTR(filter_redirects);
+WIEGAND_IN_STAT_ATTR(redirect_drops);
+WIEGAND_IN_STAT_ATTR(late_windows);
+WIEGAND_IN_STAT_ATTR(latency_min_ns);
+WIEGAND_IN_STAT_ATTR(latency_max_ns);
+
+static ssize_t latency_avg_ns_show(struct device *dev,
+                                   struct device_attribute *attr, char *buf)
+{
+    struct wiegand_in_stats total;
+    u64 frames;
+
+    wiegand_in_stats_read(wiegand_in_from_device(dev), &total);
+    frames = total.frames_ok + total.keys + total.length_errors + total.parity_errors;
+    return sprintf(buf, "%llu\n", frames ? div64_u64(total.latency_sum_ns, frames) : 0);
+}
+static DEVICE_ATTR_RO(latency_avg_ns);
+
+static struct attribute *wiegand_in_stats_attrs[] = {
+    &dev_attr_irqs.attr,
+    &dev_attr_glitches.attr,
+    &dev_attr_gap_resets.attr,
+    &dev_attr_frames_ok.attr,
+    &dev_attr_length_errors.attr,
+    &dev_attr_parity_errors.attr,
+    &dev_attr_overruns.attr,
+    &dev_attr_line_faults.attr,
+    &dev_attr_keys.attr,
+    &dev_attr_filter_drops.attr,
+    &dev_attr_filter_tags.attr,
+    &dev_attr_filter_redirects.attr,
+    &dev_attr_redirect_drops.attr,
+    &dev_attr_late_windows.attr,
+    &dev_attr_latency_min_ns.attr,
+    &dev_attr_latency_avg_ns.attr,
+    &dev_attr_latency_max_ns.attr,
+    NULL,
+};
+
+/* /sys/class/misc/wiegand_inN/statistics/ */
+static const struct attribute_group wiegand_in_stats_group = {
+    .name = "statistics",
+    .attrs = wiegand_in_stats_attrs,
+};
+
+/*
+ * Pin both interrupts to cpu, -1 hands them back to any online CPU. The
+ * frame window hrtimer is started from them, pinned, so it follows.
+ */
+static int wiegand_in_set_cpu(struct wiegand_in_dev *wiegand_in, int cpu)
+{
+    const struct cpumask *mask = cpu >= 0 ? cpumask_of(cpu) : cpu_online_mask;
+    int ret;
+
+    if (cpu < -1 || (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu)))) {
+        return -EINVAL;
+    }
+    ret = wiegand_irq_pin(wiegand_in->irq0, mask);
+    if (!ret) {
+        ret = wiegand_irq_pin(wiegand_in->irq1, mask);
+    }
+    if (cpu < 0) {
+        wiegand_irq_unpin(wiegand_in->irq0);
+        wiegand_irq_unpin(wiegand_in->irq1);
+    }
+    if (ret) {
+        return ret;
+    }
+    WRITE_ONCE(wiegand_in->cpu, cpu);
+    return 0;
+}
+
+static ssize_t wiegand_in_cpu_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(wiegand_in_from_device(dev)->cpu));
+}
+
+static ssize_t wiegand_in_cpu_store(struct device *dev, struct device_attribute *attr,
+                                    const char *buf, size_t count)
+{
+    struct wiegand_in_dev *wiegand_in = wiegand_in_from_device(dev);
+    int cpu, ret;
+
+    ret = kstrtoint(buf, 0, &cpu);
+    if (ret) {
+        return ret;
+    }
+    mutex_lock(&wiegand_in->config_lock);
+    ret = wiegand_in_set_cpu(wiegand_in, cpu);
+    mutex_unlock(&wiegand_in->config_lock);
+    return ret ? ret : count;
+}
+
+static struct device_attribute dev_attr_cpu =
+    __ATTR(cpu, 0644, wiegand_in_cpu_show, wiegand_in_cpu_store);
+
+static struct attribute *wiegand_in_attrs[] = {
+    &dev_attr_cpu.attr,
+    NULL,
+};
+
+/* /sys/class/misc/wiegand_inN/ */
+static const struct attribute_group wiegand_in_group = {
+    .attrs = wiegand_in_attrs,
+};
+
+static const struct attribute_group *wiegand_in_groups[] = {
+    &wiegand_in_group,
+    &wiegand_in_stats_group,
+    NULL,
+};
+
+static void wiegand_in_lines_checked(struct wiegand_in_dev *wiegand_in, bool fault)
 {
-    if (wiegand_in->recvd_length == wiegand_in->data_length - 1) {
-        memcpy(wiegand_in->wiegand_in_data, wiegand_in->current_data, sizeof(wiegand_in->current_data));
-        wiegand_in->recvd_length = -1;
-        wiegand_in->current_data[0] = 0;
-        wiegand_in->current_data[1] = 0;
+    if (fault && !wiegand_in->line_fault) {
+        wiegand_in_stats_inc(wiegand_in, line_faults);
+        dev_warn_ratelimited(wiegand_in->dev, "%s: data line stuck low\n", __func__);
+    }
+    WRITE_ONCE(wiegand_in->line_fault, fault);
+    /* Pollers see POLLERR now, not with the next coalesced wakeup */
+    if (fault) {
         wake_up_interruptible(&wiegand_in->wq);
+    }
+}
+
+static void wiegand_in_lines_work(struct work_struct *work)
+{
+    struct wiegand_in_dev *wiegand_in = container_of(work, struct wiegand_in_dev, lines_work);
+    bool fault = !gpio_get_value_cansleep(wiegand_in->data0_pin) ||
+                 !gpio_get_value_cansleep(wiegand_in->data1_pin);
+
+    /* The stats are only updated with interrupts off */
+    local_irq_disable();
+    wiegand_in_lines_checked(wiegand_in, fault);
+    local_irq_enable();
+}
+
+/* From the frame window hrtimer, when the lines should be idle high */
+static void wiegand_in_check_lines(struct wiegand_in_dev *wiegand_in)
+{
+    if (wiegand_in->cansleep) {
+        schedule_work(&wiegand_in->lines_work);
+        return;
+    }
+    wiegand_in_lines_checked(wiegand_in, !gpio_get_value(wiegand_in->data0_pin) ||
+                                         !gpio_get_value(wiegand_in->data1_pin));
+}
+
+#ifdef CONFIG_WIEGAND_INPUT
+/*
+ * Good frames only: MSC_SCAN carries the card data, frames wider than 32
+ * bits add their raw bits as two MSC_RAW events, high word first.
+ */
+static const unsigned short wiegand_in_keycodes[] = {
+    KEY_NUMERIC_0, KEY_NUMERIC_1, KEY_NUMERIC_2, KEY_NUMERIC_3,
+    KEY_NUMERIC_4, KEY_NUMERIC_5, KEY_NUMERIC_6, KEY_NUMERIC_7,
+    KEY_NUMERIC_8, KEY_NUMERIC_9, KEY_NUMERIC_STAR, KEY_NUMERIC_POUND,
+};
+
+static void wiegand_in_report_input(struct wiegand_in_dev *wiegand_in, const struct wiegand_frame *frame)
+{
+    if (!wiegand_in->input ||
+        (frame->status != WIEGAND_FRAME_OK && frame->status != WIEGAND_FRAME_KEY)) {
+        return;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+    input_set_timestamp(wiegand_in->input, ns_to_ktime(frame->timestamp_ns));
+#endif
+    /* A burst is a whole key press */
+    if (frame->status == WIEGAND_FRAME_KEY) {
+        input_report_key(wiegand_in->input, wiegand_in_keycodes[frame->data], 1);
+        input_sync(wiegand_in->input);
+        input_report_key(wiegand_in->input, wiegand_in_keycodes[frame->data], 0);
+        input_sync(wiegand_in->input);
+        return;
+    }
+
+    input_event(wiegand_in->input, EV_MSC, MSC_SCAN, frame->data);
+    if (frame->bits > 32) {
+        input_event(wiegand_in->input, EV_MSC, MSC_RAW, frame->raw[1]);
+        input_event(wiegand_in->input, EV_MSC, MSC_RAW, frame->raw[0]);
+    }
+    input_sync(wiegand_in->input);
+}
+
+/* An evdev reader like InputReader is a user of the port, without the node open */
+static int wiegand_in_input_open(struct input_dev *input)
+{
+    struct wiegand_in_dev *wiegand_in = input_get_drvdata(input);
+
+    mutex_lock(&wiegand_in->users_lock);
+    if (!wiegand_in_in_use(wiegand_in)) {
+        wiegand_in_start(wiegand_in);
+    }
+    wiegand_in->input_open = true;
+    mutex_unlock(&wiegand_in->users_lock);
+    return 0;
+}
+
+static void wiegand_in_input_close(struct input_dev *input)
+{
+    struct wiegand_in_dev *wiegand_in = input_get_drvdata(input);
+
+    mutex_lock(&wiegand_in->users_lock);
+    wiegand_in->input_open = false;
+    if (!wiegand_in_in_use(wiegand_in)) {
+        wiegand_in_stop(wiegand_in);
+    }
+    mutex_unlock(&wiegand_in->users_lock);
+}
+
+static int wiegand_in_register_input(struct wiegand_in_dev *wiegand_in)
+{
+    struct device *dev = &wiegand_in->platform_dev->dev;
+    struct input_dev *input;
+    int ret;
+
+    if (!of_property_read_bool(dev->of_node, "wiegand,input-device")) {
+        return 0;
+    }
+
+    input = devm_input_allocate_device(dev);
+    if (!input) {
+        return -ENOMEM;
+    }
+    /* devm outlives wiegand_in, which remove() frees first */
+    input->name = devm_kstrdup(dev, wiegand_in->name, GFP_KERNEL);
+    input->phys = devm_kasprintf(dev, GFP_KERNEL, "%s/input0", wiegand_in->name);
+    input->id.bustype = BUS_HOST;
+    input->id.version = WIEGAND_UAPI_VERSION;
+    input->open = wiegand_in_input_open;
+    input->close = wiegand_in_input_close;
+    input_set_drvdata(input, wiegand_in);
+    __set_bit(EV_MSC, input->evbit);
+    __set_bit(MSC_SCAN, input->mscbit);
+    __set_bit(MSC_RAW, input->mscbit);
+    if (wiegand_in->keypad) {
+        int i;
+
+        __set_bit(EV_KEY, input->evbit);
+        for (i = 0; i < ARRAY_SIZE(wiegand_in_keycodes); i++) {
+            __set_bit(wiegand_in_keycodes[i], input->keybit);
+        }
+    }
+
+    ret = input_register_device(input);
+    if (ret < 0) {
+        return ret;
+    }
+    /* The interrupts may already be live, only publish a registered device */
+    wiegand_in->input = input;
+    return 0;
+}
+
+/*
+ * Closes it for evdev, the interrupts stop with their last user. A frame
+ * window still open may report to it until wiegand_in_put_input().
+ */
+static void wiegand_in_unregister_input(struct wiegand_in_dev *wiegand_in)
+{
+    if (wiegand_in->input) {
+        input_get_device(wiegand_in->input);
+        input_unregister_device(wiegand_in->input);
+    }
+}
+
+static void wiegand_in_put_input(struct wiegand_in_dev *wiegand_in)
+{
+    if (wiegand_in->input) {
+        input_put_device(wiegand_in->input);
+    }
+}
+#else
+static inline void wiegand_in_report_input(struct wiegand_in_dev *wiegand_in,
+                                           const struct wiegand_frame *frame) {}
+static inline int wiegand_in_register_input(struct wiegand_in_dev *wiegand_in) { return 0; }
+static inline void wiegand_in_unregister_input(struct wiegand_in_dev *wiegand_in) {}
+static inline void wiegand_in_put_input(struct wiegand_in_dev *wiegand_in) {}
+#endif
+
+static void wiegand_in_redirect_work(struct work_struct *work)
+{
+    struct wiegand_in_dev *wiegand_in = container_of(work, struct wiegand_in_dev, redirect_work);
+    struct wiegand_hub_write req;
+    int ret;
+
+    while (kfifo_get(&wiegand_in->redirects, &req)) {
+        ret = wiegand_hub_forward(req.port, req.data);
+        if (ret) {
+            dev_warn_ratelimited(wiegand_in->dev, "%s: wiegand_out port %u, ret=%d\n",
+                                 __func__, req.port, ret);
+        }
+    }
+}
+
+/* The hrtimer is the only producer, the work the only consumer */
+static void wiegand_in_redirect(struct wiegand_in_dev *wiegand_in, u16 port, u32 data)
+{
+    struct wiegand_hub_write req = {
+        .data = data,
+        .port = port,
+    };
+    int cpu;
+
+    if (!kfifo_put(&wiegand_in->redirects, req)) {
+        wiegand_in_stats_inc(wiegand_in, redirect_drops);
+        dev_warn_ratelimited(wiegand_in->dev, "%s: redirect queue full, frame dropped\n", __func__);
+        return;
+    }
+    wiegand_in_stats_inc(wiegand_in, filter_redirects);
+    /* Next to the interrupts on wiegand,cpu, while it is online */
+    cpu = READ_ONCE(wiegand_in->cpu);
+    if (cpu >= 0 && cpu_online(cpu)) {
+        queue_work_on(cpu, wiegand_in->redirect_wq, &wiegand_in->redirect_work);
     } else {
-        printk("recvd data error: received length = %d, required length = %d\n",
-               wiegand_in->recvd_length, wiegand_in->data_length);
-        wiegand_in_data_reset(wiegand_in);
-        wiegand_in->error = 1;
-        wake_up_interruptible(&wiegand_in->wq);
+        queue_work(wiegand_in->redirect_wq, &wiegand_in->redirect_work);
+    }
+}
+
+static void wiegand_in_queue_frame(struct wiegand_in_dev *wiegand_in, const struct wiegand_frame *frame)
+{
+    struct wiegand_frame tagged;
+    const struct wiegand_frame *queued = frame;
+    unsigned long flags;
+    bool dropped = false;
+    u32 action;
+
+    trace_wiegand_in_frame(frame);
+    wiegand_in_stats_frame(wiegand_in, frame, ktime_get_ns() - frame->timestamp_ns);
+
+    /* Filtered out frames never reach the fifo, so never wake a reader */
+    action = wiegand_in_filter_run(wiegand_in, frame);
+    switch (action & WIEGAND_FILTER_ACTION) {
+    case WIEGAND_FILTER_DELIVER:
+        break;
+    case WIEGAND_FILTER_TAG:
+        tagged = *frame;
+        tagged.status |= (action & 0x0f) << WIEGAND_FRAME_TAG_SHIFT;
+        queued = &tagged;
+        wiegand_in_stats_inc(wiegand_in, filter_tags);
+        break;
+    case WIEGAND_FILTER_REDIRECT:
+        wiegand_in_redirect(wiegand_in, action & WIEGAND_FILTER_ARG, frame->data);
+        return;
+    default:
+        wiegand_in_stats_inc(wiegand_in, filter_drops);
+        return;
+    }
+
+    /* With only the hub attached nobody would drain the fifo */
+    spin_lock_irqsave(&wiegand_in->lock, flags);
+    if (wiegand_in->use_count > 0) {
+        dropped = !kfifo_put(&wiegand_in->frames, *queued);
+        wiegand_in_update_readable(wiegand_in);
+    }
+    spin_unlock_irqrestore(&wiegand_in->lock, flags);
+    if (dropped) {
+        wiegand_in_stats_inc(wiegand_in, overruns);
+        dev_warn_ratelimited(wiegand_in->dev, "%s: frame fifo full, frame dropped\n", __func__);
+    }
+    wiegand_hub_frame(queued);
+    /* Input events carry no tag */
+    wiegand_in_report_input(wiegand_in, frame);
+}
+
+/*
+ * 4 bit bursts are the key code, 8 bit ones the complement of the key code
+ * followed by the key code. Returns the WIEGAND_KEY_* or -1.
+ */
+static int wiegand_in_decode_key(const struct wiegand_frame *frame)
+{
+    unsigned int key = frame->raw[0] & 0x0f;
+
+    if (frame->bits == 8 && ((frame->raw[0] >> 4) & 0x0f) != (~key & 0x0f)) {
+        return -1;
+    }
+    return key <= WIEGAND_KEY_HASH ? key : -1;
+}
+
+/*
+ * Collect digits until the terminator key, then queue them as one PIN
+ * frame. The other of * and # clears the digits, and so does a pause
+ * longer than pin_timeout_ms.
+ */
+static void wiegand_in_assemble_pin(struct wiegand_in_dev *wiegand_in, const struct wiegand_frame *key)
+{
+    struct wiegand_frame frame;
+
+    if (wiegand_in->pin_terminator < 0) {
+        return;
+    }
+    if (wiegand_in->pin_digits > 0 && wiegand_in->pin_timeout_ms &&
+        key->timestamp_ns - wiegand_in->pin_last_ns > (u64)wiegand_in->pin_timeout_ms * NSEC_PER_MSEC) {
+        wiegand_in->pin_digits = 0;
+    }
+    wiegand_in->pin_last_ns = key->timestamp_ns;
+
+    if (key->data == wiegand_in->pin_terminator) {
+        if (wiegand_in->pin_digits > 0) {
+            frame = *key;
+            frame.raw[0] = wiegand_in->pin;
+            frame.raw[1] = 0;
+            frame.data = wiegand_in->pin;
+            frame.bits = wiegand_in->pin_digits * 4;
+            frame.status = WIEGAND_FRAME_PIN;
+            wiegand_in_queue_frame(wiegand_in, &frame);
+        }
+        wiegand_in->pin_digits = 0;
+    } else if (key->data > 9) {
+        wiegand_in->pin_digits = 0;
+    } else if (wiegand_in->pin_digits < WIEGAND_PIN_DIGITS) {
+        if (wiegand_in->pin_digits == 0) {
+            wiegand_in->pin = 0;
+        }
+        wiegand_in->pin = (wiegand_in->pin << 4) | key->data;
+        wiegand_in->pin_digits++;
+    }
+}
+
+static void wiegand_in_check_data(struct wiegand_in_dev *wiegand_in)
+{
+    struct wiegand_frame frame;
+    int key = -1;
+
+    frame.timestamp_ns = wiegand_in->last_edge_ns;
+    frame.raw[0] = wiegand_in->current_data[0];
+    frame.raw[1] = wiegand_in->current_data[1];
+    frame.port = wiegand_in->port;
+    frame.bits = wiegand_in->recvd_length + 1;
+
+    if (wiegand_in->keypad && (frame.bits == 4 || frame.bits == 8)) {
+        key = wiegand_in_decode_key(&frame);
+        frame.data = key < 0 ? 0 : key;
+        frame.status = key < 0 ? WIEGAND_FRAME_PARITY_ERROR : WIEGAND_FRAME_KEY;
+    } else if (wiegand_in->recvd_length == wiegand_in->frame_cfg.format - 1) {
+        frame.data = wiegand_in_rm_parity_bits(&frame);
+        frame.status = wiegand_in_check_parity(&frame);
+    } else {
+        dev_dbg(wiegand_in->dev, "recvd data error: received length = %d, required length = %d\n",
+                wiegand_in->recvd_length, wiegand_in->frame_cfg.format);
+        frame.data = 0;
+        frame.status = WIEGAND_FRAME_LENGTH_ERROR;
+    }
+    wiegand_in_data_reset(wiegand_in);
+    /* Ends the hold of the frame window, after a last grace period */
+    pm_wakeup_event(wiegand_in->dev, WIEGAND_WAKEUP_HOLD_MS);
+
+    /* Both lines idle high between frames, a low one is stuck or shorted */
+    wiegand_in_check_lines(wiegand_in);
+
+    wiegand_in_queue_frame(wiegand_in, &frame);
+    if (key >= 0) {
+        wiegand_in_assemble_pin(wiegand_in, &frame);
     }
 }
 
 static enum hrtimer_restart wiegand_in_timeout(struct hrtimer * timer)
 {
     struct wiegand_in_dev *wiegand_in = container_of(timer, struct wiegand_in_dev, timer);
+
+    /* A late close holds the frame back and can cut the next one short */
+    if (ktime_to_us(ktime_sub(ktime_get(), hrtimer_get_expires(timer))) >
+        wiegand_in->frame_cfg.tolerance) {
+        wiegand_in_stats_inc(wiegand_in, late_windows);
+    }
     wiegand_in_check_data(wiegand_in);
     return HRTIMER_NORESTART;
 }
 
+/*
+ * The frame window covers a whole frame of the configured format. Keypad
+ * ports send shorter bursts, so there the window ends once the lines were
+ * idle for the gap that starts a new frame in wiegand_in_check_irq(), and
+ * is restarted on every edge.
+ */
 static void wiegand_in_reset_timer(struct wiegand_in_dev *wiegand_in)
 {
-    int us = (wiegand_in->pulse_width + wiegand_in->pulse_intval)
-             * wiegand_in->data_length;
+    const struct wiegand_config *cfg = &wiegand_in->frame_cfg;
+    int us = (cfg->pulse_width + cfg->pulse_intval) * (wiegand_in->keypad ? 3 : cfg->format);
     int s = us / 1000000;
     ktime_t time = ktime_set(s, (us % 1000000) * 1000);
-    hrtimer_start(&wiegand_in->timer, time, HRTIMER_MODE_REL);
+    hrtimer_start(&wiegand_in->timer, time,
+                  READ_ONCE(wiegand_in->cpu) >= 0 ? HRTIMER_MODE_REL_PINNED : HRTIMER_MODE_REL);
 }
 
-static int wiegand_in_check_irq(struct wiegand_in_dev *wiegand_in)
+static int wiegand_in_check_irq(struct wiegand_in_dev *wiegand_in, u64 now)
 {
+    const struct wiegand_config *cfg = &wiegand_in->frame_cfg;
     long diff;
 
     if (wiegand_in->recvd_length < 0) {
-        do_gettimeofday(&wiegand_in->latest);
         return 0;
     }
 
     /* Check how much time we have used already */
-    do_gettimeofday(&wiegand_in->now);
-    diff = wiegand_in->now.tv_usec - wiegand_in->latest.tv_usec;
-    if (diff < 0) {
-        diff = wiegand_in->pulse_width;
-    }
+    diff = div_u64(now - wiegand_in->last_edge_ns, NSEC_PER_USEC);
 
     /* check fake interrupt */
-    if (diff < wiegand_in->pulse_width - DEVIATION) {
-        dev_err(wiegand_in->dev, "%s: Pulse width is required: %d, actually: %ld, now: %ld, latest: %ld\n", 
-            __func__, wiegand_in->pulse_width, diff, wiegand_in->now.tv_usec, wiegand_in->latest.tv_usec);
+    if (diff < (long)cfg->pulse_width - (long)cfg->tolerance) {
+        trace_wiegand_in_glitch(wiegand_in->port, diff, cfg->pulse_width);
+        wiegand_in_stats_inc(wiegand_in, glitches);
+        dev_dbg(wiegand_in->dev, "%s: Pulse width is required: %u, actually: %ld\n", 
+            __func__, cfg->pulse_width, diff);
         return -1;
     }
     /*
@@ -354,32 +1511,63 @@ static int wiegand_in_check_irq(struct wiegand_in_dev *wiegand_in)
      * then cheet it as beginning of another scan
      * and discard current data
      */
-    else if (diff > wiegand_in->pulse_width + wiegand_in->pulse_intval
-             + ((wiegand_in->pulse_width + wiegand_in->pulse_intval) << 1)) {
-        dev_err(wiegand_in->dev, "%s: Pulse width is required: %d, actually: %ld\n", 
-            __func__, wiegand_in->pulse_width, diff);
+    else if (diff > cfg->pulse_width + cfg->pulse_intval
+             + ((cfg->pulse_width + cfg->pulse_intval) << 1)) {
+        dev_dbg(wiegand_in->dev, "%s: Pulse width is required: %u, actually: %ld\n", 
+            __func__, cfg->pulse_width, diff);
+        wiegand_in_stats_inc(wiegand_in, gap_resets);
         hrtimer_cancel(&wiegand_in->timer);
         wiegand_in_data_reset(wiegand_in);
+        pm_relax(wiegand_in->dev);
         return -1;
     }
 
-    wiegand_in->latest.tv_sec = wiegand_in->now.tv_sec;
-    wiegand_in->latest.tv_usec = wiegand_in->now.tv_usec;
     return 0;
 }
 
+/* Snapshot the profile, a frame is decoded with the one it started with */
+static void wiegand_in_frame_begin(struct wiegand_in_dev *wiegand_in)
+{
+    rcu_read_lock();
+    wiegand_in->frame_cfg = rcu_dereference(wiegand_in->profile)->cfg;
+    rcu_read_unlock();
+}
+
 static irqreturn_t wiegand_in_interrupt(int irq, void *dev_id)
 {
     struct wiegand_in_dev *wiegand_in = (struct wiegand_in_dev *)dev_id;
-
-    if (wiegand_in_check_irq(wiegand_in)) {
-        return IRQ_HANDLED;
-    }
-
-    if (wiegand_in->recvd_length < 0) {
-        wiegand_in_reset_timer(wiegand_in);
+    u64 now;
+
+    wiegand_in_stats_inc(wiegand_in, irqs);
+
+    if (READ_ONCE(wiegand_in->suspended)) {
+        /*
+         * Resuming from a swipe: the replayed wake edge and the ones after
+         * it come in before the noirq resume, with IRQF_EARLY_RESUME. The
+         * replay is late, so no timing checks, and no frame window until
+         * wiegand_in_resume_noirq() starts it.
+         */
+        now = ktime_get_mono_fast_ns();
+        if (wiegand_in->recvd_length < 0) {
+            wiegand_in_frame_begin(wiegand_in);
+            pm_stay_awake(wiegand_in->dev);
+        }
+    } else {
+        now = ktime_get_ns();
+        if (wiegand_in_check_irq(wiegand_in, now)) {
+            return IRQ_HANDLED;
+        }
+        if (wiegand_in->recvd_length < 0) {
+            wiegand_in_frame_begin(wiegand_in);
+            /* Hold the system awake for the frame window, this also aborts a suspend in progress */
+            pm_stay_awake(wiegand_in->dev);
+            wiegand_in_reset_timer(wiegand_in);
+        } else if (wiegand_in->keypad) {
+            wiegand_in_reset_timer(wiegand_in);
+        }
     }
 
+    wiegand_in->last_edge_ns = now;
     wiegand_in->recvd_length++;
     wiegand_in->current_data[1] <<= 1;
     wiegand_in->current_data[1] |= ((wiegand_in->current_data[0] >> 31) & 0x01);
@@ -387,11 +1575,13 @@ static irqreturn_t wiegand_in_interrupt(int irq, void *dev_id)
     if (irq == wiegand_in->irq1) {
         wiegand_in->current_data[0] |= 1;
     }
+    trace_wiegand_in_edge(wiegand_in->port, wiegand_in->recvd_length, irq == wiegand_in->irq1);
     return IRQ_HANDLED;
 }
 
 static int wiegand_in_parse_dt(struct device *dev,
-                               struct wiegand_in_dev *wiegand)
+                               struct wiegand_in_dev *wiegand,
+                               struct wiegand_config *cfg)
 {
     int ret = 0;
     struct device_node *np = dev->of_node;
@@ -408,23 +1598,30 @@ static int wiegand_in_parse_dt(struct device *dev,
         return -1;
     }
 
-    ret = of_property_read_u32(np, "wiegand,data_length", &wiegand->data_length);
+    ret = of_property_read_u32(np, "wiegand,port", &wiegand->port);
     if (ret) {
-        wiegand->data_length = DEF_DATA_LENGTH;
+        wiegand->port = 0;
     }
 
-    ret = of_property_read_u32(np, "wiegand,pulse_width", &wiegand->pulse_width);
-    if (ret) {
-        wiegand->pulse_width = DEF_PULSE_WIDTH;
-    }
+    /* Absent properties leave the defaults in cfg */
+    of_property_read_u32(np, "wiegand,data_length", &cfg->format);
+    of_property_read_u32(np, "wiegand,pulse_width", &cfg->pulse_width);
+    of_property_read_u32(np, "wiegand,pulse_intval", &cfg->pulse_intval);
+    of_property_read_u32(np, "wiegand,tolerance", &cfg->tolerance);
 
-    ret = of_property_read_u32(np, "wiegand,pulse_intval", &wiegand->pulse_intval);
-    if (ret) {
-        wiegand->pulse_intval = DEF_PULSE_INTERVAL;
+    wiegand->wakeup = of_property_read_bool(np, "wakeup-source");
+
+    wiegand->keypad = of_property_read_bool(np, "wiegand,keypad");
+    if (of_property_read_u32(np, "wiegand,pin-terminator", &wiegand->pin_terminator) ||
+        wiegand->pin_terminator < WIEGAND_KEY_STAR || wiegand->pin_terminator > WIEGAND_KEY_HASH) {
+        wiegand->pin_terminator = -1;
     }
+    of_property_read_u32(np, "wiegand,pin-timeout-ms", &wiegand->pin_timeout_ms);
+    of_property_read_u32(np, "wiegand,cpu", &wiegand->cpu);
 
-    dev_info(dev, "%s: data_length=%d pulse_width=%d pulse_intval=%d\n", __func__,
-             wiegand->data_length, wiegand->pulse_width, wiegand->pulse_intval);
+    dev_info(dev, "%s: port=%d data_length=%u pulse_width=%u pulse_intval=%u tolerance=%u\n",
+             __func__, wiegand->port, cfg->format, cfg->pulse_width, cfg->pulse_intval,
+             cfg->tolerance);
 
     return 0;
 }
@@ -467,6 +1664,12 @@ static int wiegand_in_request_io_port(struct wiegand_in_dev *wiegand_in)
 static int wiegand_in_request_irq(struct wiegand_in_dev *wiegand_in)
 {
     int ret = 0;
+    unsigned long flags = IRQF_TRIGGER_FALLING;
+
+    /* A wake source gets its lines back at syscore resume, see wiegand_in_interrupt() */
+    if (wiegand_in->wakeup) {
+        flags |= IRQF_EARLY_RESUME;
+    }
 
     /* use irq */
     if (gpio_is_valid(wiegand_in->data0_pin) || wiegand_in->irq0 > 0) {
@@ -478,7 +1681,7 @@ static int wiegand_in_request_irq(struct wiegand_in_dev *wiegand_in)
                  wiegand_in->irq0, IRQF_TRIGGER_FALLING);
         ret = request_irq(wiegand_in->irq0,
                           wiegand_in_interrupt,
-                          IRQF_TRIGGER_FALLING,
+                          flags,
                           "wiegand_in_data0", wiegand_in);
 
         if (ret < 0) {
@@ -498,7 +1701,7 @@ static int wiegand_in_request_irq(struct wiegand_in_dev *wiegand_in)
                  wiegand_in->irq1, IRQF_TRIGGER_FALLING);
         ret = request_irq(wiegand_in->irq1,
                           wiegand_in_interrupt,
-                          IRQF_TRIGGER_FALLING,
+                          flags,
                           "wiegand_in_data1", wiegand_in);
 
         if (ret < 0) {
@@ -514,8 +1717,14 @@ static int wiegand_in_request_irq(struct wiegand_in_dev *wiegand_in)
 
 static int wiegand_in_probe(struct platform_device *pdev)
 {
-    int ret;
+    int ret, cpu;
     struct wiegand_in_dev *wiegand_in;
+    struct wiegand_config cfg = {
+        .format = DEF_DATA_LENGTH,
+        .pulse_width = DEF_PULSE_WIDTH,
+        .pulse_intval = DEF_PULSE_INTERVAL,
+        .tolerance = DEVIATION,
+    };
 
     dev_info(&pdev->dev, "%s: WIEGAND IN VERSION = %s\n", __func__, WIEGANDINDRV_LIB_VERSION);
 
@@ -525,14 +1734,38 @@ static int wiegand_in_probe(struct platform_device *pdev)
         return -ENOMEM;
     }
 
+    /* Before the irqs, which count into it */
+    wiegand_in->stats = alloc_percpu(struct wiegand_in_stats);
+    if (!wiegand_in->stats) {
+        ret = -ENOMEM;
+        goto exit_free_data;
+    }
+    for_each_possible_cpu(cpu) {
+        struct wiegand_in_stats *st = per_cpu_ptr(wiegand_in->stats, cpu);
+
+        u64_stats_init(&st->syncp);
+        st->latency_min_ns = U64_MAX;
+    }
+
+    wiegand_in->pin_terminator = -1;
+    wiegand_in->cpu = -1;
     if (pdev->dev.of_node) {
-        ret = wiegand_in_parse_dt(&pdev->dev, wiegand_in);
+        ret = wiegand_in_parse_dt(&pdev->dev, wiegand_in, &cfg);
         if (ret) {
             dev_err(&pdev->dev, "%s: Failed parse dts.\n", __func__);
             goto exit_free_data;
         }
     }
 
+    mutex_init(&wiegand_in->config_lock);
+    mutex_lock(&wiegand_in->config_lock);
+    ret = wiegand_in_config_publish(wiegand_in, &cfg);
+    mutex_unlock(&wiegand_in->config_lock);
+    if (ret) {
+        dev_err(&pdev->dev, "%s: Invalid format or timing.\n", __func__);
+        goto exit_free_data;
+    }
+
     wiegand_in->platform_dev = pdev;
 
     ret = wiegand_in_request_io_port(wiegand_in);
@@ -540,6 +1773,9 @@ static int wiegand_in_probe(struct platform_device *pdev)
         dev_err(&pdev->dev, "%s: Failed request IO port.\n", __func__);
         goto exit_free_data;
     }
+    wiegand_in->cansleep = gpio_cansleep(wiegand_in->data0_pin) ||
+                           gpio_cansleep(wiegand_in->data1_pin);
+    INIT_WORK(&wiegand_in->lines_work, wiegand_in_lines_work);
 
     ret = wiegand_in_request_irq(wiegand_in);
     if (ret < 0) {
@@ -547,30 +1783,81 @@ static int wiegand_in_probe(struct platform_device *pdev)
         goto exit_free_io_port;
     }
 
+    /* wiegand,cpu was only parsed, it takes effect with the interrupts */
+    cpu = wiegand_in->cpu;
+    wiegand_in->cpu = -1;
+    if (cpu >= 0 && wiegand_in_set_cpu(wiegand_in, cpu)) {
+        dev_warn(&pdev->dev, "%s: Can't pin to cpu %d.\n", __func__, cpu);
+    }
+
     wiegand_in->dev = &pdev->dev;
     wiegand_in->mdev.minor = MISC_DYNAMIC_MINOR;
-    wiegand_in->mdev.name =  WIEGAND_DEIVCE_NAME;
+    /* Port 0 keeps the legacy node name, further ports are numbered */
+    if (wiegand_in->port > 0) {
+        snprintf(wiegand_in->name, sizeof(wiegand_in->name), "%s%d", WIEGAND_DEIVCE_NAME, wiegand_in->port);
+    } else {
+        snprintf(wiegand_in->name, sizeof(wiegand_in->name), "%s", WIEGAND_DEIVCE_NAME);
+    }
+    wiegand_in->mdev.name = wiegand_in->name;
     wiegand_in->mdev.fops = &wiegand_in_misc_fops;
+    wiegand_in->mdev.groups = wiegand_in_groups;
 
     wiegand_in_data_reset(wiegand_in);
 
     spin_lock_init(&wiegand_in->lock);
+    mutex_init(&wiegand_in->users_lock);
+    INIT_KFIFO(wiegand_in->frames);
+    INIT_KFIFO(wiegand_in->redirects);
+    INIT_WORK(&wiegand_in->redirect_work, wiegand_in_redirect_work);
+    /*
+     * Per-CPU so the work can follow wiegand,cpu. The one work item never
+     * runs twice at once and drains the queue, so frames still leave in
+     * the order they were read.
+     */
+    wiegand_in->redirect_wq = alloc_workqueue("%s_redirect", WQ_HIGHPRI, 1, wiegand_in->name);
+    if (!wiegand_in->redirect_wq) {
+        ret = -ENOMEM;
+        goto exit_free_irq;
+    }
     init_waitqueue_head(&wiegand_in->wq);
     hrtimer_init(&wiegand_in->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
     wiegand_in->timer.function = wiegand_in_timeout;
+    hrtimer_init(&wiegand_in->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    wiegand_in->coalesce_timer.function = wiegand_in_coalesce_timeout;
+    wiegand_in->coalesce.frames = 1;
+
+    ret = wiegand_in_register_input(wiegand_in);
+    if (ret < 0) {
+        dev_err(&pdev->dev, "%s: input device register failed.\n", __func__);
+        goto exit_free_wq;
+    }
 
     ret = misc_register(&wiegand_in->mdev);
     if (ret < 0) {
         dev_err(&pdev->dev, "%s: misc register failed.\n", __func__);
-        goto exit_free_irq;
+        /* Its close() must not run after wiegand_in is freed */
+        wiegand_in_unregister_input(wiegand_in);
+        wiegand_in_put_input(wiegand_in);
+        goto exit_free_wq;
     }
 
     platform_set_drvdata(pdev, wiegand_in);
+    device_init_wakeup(&pdev->dev, wiegand_in->wakeup);
+
+    wiegand_in->hub.port = wiegand_in->port;
+    wiegand_in->hub.attach = wiegand_in_hub_attach;
+    wiegand_in->hub.detach = wiegand_in_hub_detach;
+    wiegand_hub_add_in(&wiegand_in->hub);
     dev_info(&pdev->dev, "%s: Weigand in driver register success.\n", __func__);
 
     return 0;
 
+exit_free_wq:
+    destroy_workqueue(wiegand_in->redirect_wq);
+
 exit_free_irq:
+    wiegand_irq_unpin(wiegand_in->irq0);
+    wiegand_irq_unpin(wiegand_in->irq1);
     free_irq(wiegand_in->irq0, wiegand_in);
     free_irq(wiegand_in->irq1, wiegand_in);
 
@@ -583,6 +1870,8 @@ exit_free_io_port:
     }
 
 exit_free_data:
+    kfree(rcu_dereference_protected(wiegand_in->profile, 1));
+    free_percpu(wiegand_in->stats);
     kfree(wiegand_in);
     return ret;
 }
@@ -590,16 +1879,103 @@ exit_free_data:
 static int wiegand_in_remove(struct platform_device *dev)
 {
     struct wiegand_in_dev *wiegand_in = platform_get_drvdata(dev);
+    wiegand_hub_del_in(&wiegand_in->hub);
     misc_deregister(&wiegand_in->mdev);
+    wiegand_in_unregister_input(wiegand_in);
+    device_init_wakeup(&dev->dev, false);
+    /* free_irq() warns about a hint left behind */
+    wiegand_irq_unpin(wiegand_in->irq0);
+    wiegand_irq_unpin(wiegand_in->irq1);
     free_irq(gpio_to_irq(wiegand_in->data0_pin), wiegand_in);
     free_irq(gpio_to_irq(wiegand_in->data1_pin), wiegand_in);
+    /*
+     * Fds still open keep a frame in progress, its window could queue a
+     * redirect or arm the coalescing timer, so that one goes last.
+     */
+    hrtimer_cancel(&wiegand_in->timer);
+    hrtimer_cancel(&wiegand_in->coalesce_timer);
+    cancel_work_sync(&wiegand_in->lines_work);
+    wiegand_in_put_input(wiegand_in);
     gpio_free(wiegand_in->data0_pin);
     gpio_free(wiegand_in->data1_pin);
+    destroy_workqueue(wiegand_in->redirect_wq);
+    kfree(rcu_dereference_protected(wiegand_in->profile, 1));
+    wiegand_in_filter_free(rcu_dereference_protected(wiegand_in->filter, 1));
+    /* Filters replaced earlier are freed by code of this module */
+    rcu_barrier();
+    free_percpu(wiegand_in->stats);
     kfree(wiegand_in);
 
     return 0;
 }
 
+#ifdef CONFIG_PM_SLEEP
+/* Only a port in use has its interrupts enabled, so only it can wake us */
+static bool wiegand_in_may_wakeup(struct wiegand_in_dev *wiegand_in)
+{
+    return device_may_wakeup(wiegand_in->dev) && wiegand_in_in_use(wiegand_in);
+}
+
+static int wiegand_in_suspend(struct device *dev)
+{
+    struct wiegand_in_dev *wiegand_in = platform_get_drvdata(to_platform_device(dev));
+
+    if (wiegand_in_may_wakeup(wiegand_in)) {
+        enable_irq_wake(wiegand_in->irq0);
+        enable_irq_wake(wiegand_in->irq1);
+    }
+    return 0;
+}
+
+static int wiegand_in_resume(struct device *dev)
+{
+    struct wiegand_in_dev *wiegand_in = platform_get_drvdata(to_platform_device(dev));
+
+    if (wiegand_in_may_wakeup(wiegand_in)) {
+        disable_irq_wake(wiegand_in->irq0);
+        disable_irq_wake(wiegand_in->irq1);
+    }
+    return 0;
+}
+
+/* The interrupts are suspended now, until the early resume only buffer */
+static int wiegand_in_suspend_noirq(struct device *dev)
+{
+    struct wiegand_in_dev *wiegand_in = platform_get_drvdata(to_platform_device(dev));
+
+    if (wiegand_in_may_wakeup(wiegand_in)) {
+        WRITE_ONCE(wiegand_in->suspended, true);
+    }
+    return 0;
+}
+
+/* Timers run again, start the frame window of the edges buffered so far */
+static int wiegand_in_resume_noirq(struct device *dev)
+{
+    struct wiegand_in_dev *wiegand_in = platform_get_drvdata(to_platform_device(dev));
+
+    if (!wiegand_in->suspended) {
+        return 0;
+    }
+    /*
+     * Not disable_irq(), after suspend-to-idle the interrupts are still
+     * suspended here. Handlers from now on start the window themselves.
+     */
+    WRITE_ONCE(wiegand_in->suspended, false);
+    synchronize_irq(wiegand_in->irq0);
+    synchronize_irq(wiegand_in->irq1);
+    if (wiegand_in->recvd_length >= 0 && !hrtimer_active(&wiegand_in->timer)) {
+        wiegand_in_reset_timer(wiegand_in);
+    }
+    return 0;
+}
+#endif
+
+static const struct dev_pm_ops wiegand_in_pm_ops = {
+    SET_SYSTEM_SLEEP_PM_OPS(wiegand_in_suspend, wiegand_in_resume)
+    SET_NOIRQ_SYSTEM_SLEEP_PM_OPS(wiegand_in_suspend_noirq, wiegand_in_resume_noirq)
+};
+
 static const struct of_device_id wiegand_of_match[] = {
     { .compatible =  "wiegandin"},
     {},
@@ -614,6 +1990,7 @@ static struct platform_driver wiegand_in_driver = {
         .name = WIEGAND_DEIVCE_NAME,
         .owner  = THIS_MODULE,
         .of_match_table = wiegand_of_match,
+        .pm = &wiegand_in_pm_ops,
     },
 };
 
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2021 Bob Shen.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM wiegand_in
+
+#if !defined(_WIEGAND_IN_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _WIEGAND_IN_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(wiegand_in_edge,
+
+    TP_PROTO(int port, int index, int bit),
+
+    TP_ARGS(port, index, bit),
+
+    TP_STRUCT__entry(
+        __field(int, port)
+        __field(int, index)
+        __field(int, bit)
+    ),
+
+    TP_fast_assign(
+        __entry->port = port;
+        __entry->index = index;
+        __entry->bit = bit;
+    ),
+
+    TP_printk("port=%d index=%d bit=%d", __entry->port, __entry->index, __entry->bit)
+);
+
+TRACE_EVENT(wiegand_in_glitch,
+
+    TP_PROTO(int port, long diff, int pulse_width),
+
+    TP_ARGS(port, diff, pulse_width),
+
+    TP_STRUCT__entry(
+        __field(int, port)
+        __field(long, diff)
+        __field(int, pulse_width)
+    ),
+
+    TP_fast_assign(
+        __entry->port = port;
+        __entry->diff = diff;
+        __entry->pulse_width = pulse_width;
+    ),
+
+    TP_printk("port=%d diff=%ldus pulse_width=%dus",
+              __entry->port, __entry->diff, __entry->pulse_width)
+);
+
+DECLARE_EVENT_CLASS(wiegand_in_frame_class,
+
+    TP_PROTO(const struct wiegand_frame *frame),
+
+    TP_ARGS(frame),
+
+    TP_STRUCT__entry(
+        __field(u64, timestamp_ns)
+        __field(u32, data)
+        __field(u16, port)
+        __field(u8, bits)
+        __field(u8, status)
+    ),
+
+    TP_fast_assign(
+        __entry->timestamp_ns = frame->timestamp_ns;
+        __entry->data = frame->data;
+        __entry->port = frame->port;
+        __entry->bits = frame->bits;
+        __entry->status = frame->status;
+    ),
+
+    TP_printk("port=%u bits=%u status=%u data=%08x last_edge=%llu",
+              __entry->port, __entry->bits, __entry->status, __entry->data,
+              __entry->timestamp_ns)
+);
+
+/* Frame queued by the frame window timer, status tells complete or error */
+DEFINE_EVENT(wiegand_in_frame_class, wiegand_in_frame,
+    TP_PROTO(const struct wiegand_frame *frame),
+    TP_ARGS(frame)
+);
+
+/* Frame dequeued by a reader */
+DEFINE_EVENT(wiegand_in_frame_class, wiegand_in_frame_read,
+    TP_PROTO(const struct wiegand_frame *frame),
+    TP_ARGS(frame)
+);
+
+#endif /* _WIEGAND_IN_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE wiegand_in_trace
+#include <trace/define_trace.h>
@@ -20,13 +20,14 @@
 #include <linux/delay.h>
 #include <linux/miscdevice.h>
 #include <linux/spinlock.h>
-#include <linux/wakelock.h>
 #include <linux/clk.h>
 #include <linux/syscalls.h>
 #include <linux/platform_device.h>
 #include <linux/dma-mapping.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
 #include <linux/poll.h>
+#include <linux/uio.h>
 #include <linux/sched.h>
 #include <linux/hrtimer.h>
 #include <linux/wait.h>
@@ -38,13 +39,32 @@
 #include <linux/of_gpio.h>
 #include <linux/unistd.h>
 #include <linux/of_platform.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/version.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#include <linux/workqueue.h>
+
+#include "wiegand_uapi.h"
+#include "wiegand_hub.h"
+#include "wiegand_parity.h"
+
+#define CREATE_TRACE_POINTS
+#include "wiegand_out_trace.h"
 
 #define WIEGANDOUTDRV_LIB_VERSION    "1.0.0"
 
-#define WIEGAND_DEIVCE_NAME         "wiegand_out"
+#define WIEGAND_DEIVCE_NAME         WIEGAND_OUT_DEVICE_NAME
 
-#define WIEGAND_MODE_26     26 //bit
-#define WIEGAND_MODE_34     34 //bit
+/* access_ok() lost its type argument in 5.0 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#define wiegand_access_ok(addr, size)   access_ok(addr, size)
+#else
+#define wiegand_access_ok(addr, size)   access_ok(VERIFY_WRITE, addr, size)
+#endif
 
 #define DEF_PULSE_WIDTH     100 //us
 #define DEF_PULSE_INTERVAL  1000 //us
@@ -59,117 +79,103 @@
 
 #define MAX_WIEGAND_DATA_LEN 2
 
-/* ioctl command */
-#define WIEGAND_IOC_MAGIC  'w'
+/* Index in wiegand_out_dev.lines */
+#define WIEGAND_OUT_DATA0   0
+#define WIEGAND_OUT_DATA1   1
 
-#define WIEGAND_PULSE_WIDTH     _IOW(WIEGAND_IOC_MAGIC, 1, int)
-#define WIEGAND_PULSE_INTERVAL  _IOW(WIEGAND_IOC_MAGIC, 2, int)
-#define WIEGAND_FORMAT          _IOW(WIEGAND_IOC_MAGIC, 3, int)
-#define WIEGAND_READ            _IOR(WIEGAND_IOC_MAGIC, 4, unsigned int)
-#define WIEGAND_WRITE           _IOW(WIEGAND_IOC_MAGIC, 5, unsigned int)
-#define WIEGAND_STATUS          _IOR(WIEGAND_IOC_MAGIC, 6, int)
-
-#define WIEGAND_IOC_MAXNR 6
+/* Per-CPU counters, summed when read through sysfs */
+struct wiegand_out_stats {
+    u64                     frames_sent;
+    u64                     late_edges; /* edges more than the tolerance late */
+    u64                     line_faults;
+    struct u64_stats_sync   syncp;
+};
 
+/* Immutable once published, replaced as a whole under config_lock */
+struct wiegand_out_profile {
+    struct wiegand_config   cfg;
+    struct rcu_head         rcu;
+};
 
 struct wiegand_out_dev {
     struct platform_device  *platform_dev;
     struct device           *dev;
     struct miscdevice       mdev;
+    char                    name[16];
+    int                     port;
     unsigned int            data0_pin;
     unsigned int            data1_pin;
+    struct gpio_desc        *lines[2];    /* DATA0, DATA1, idle outputs from probe on */
     unsigned int            wiegand_data;
     unsigned int            wiegand_out_data[MAX_WIEGAND_DATA_LEN];
     int                     pos;
-    int                     data_length;
-    int                     pulse_width; //us
-    int                     pulse_intval; //us
+    struct wiegand_out_profile __rcu *profile;
+    struct mutex            config_lock;
+    struct wiegand_config   frame_cfg;    /* profile of the frame on the wire */
     int                     state;
+    bool                    busy;
+    bool                    line_fault;   /* a line read back low after release */
+    int                     cpu;          /* wiegand,cpu, of the bit timer, -1 any */
+    bool                    cansleep;     /* lines on a chip that sleeps, sent by tx_work */
+    struct workqueue_struct *tx_wq;
+    struct work_struct      tx_work;
     spinlock_t              lock;
     int                     use_count;
     struct hrtimer          timer;
+    struct wiegand_out_stats __percpu *stats;
     wait_queue_head_t       wq;
+    struct wiegand_hub_out  hub;
 };
 
-static unsigned char odd_parity_26(unsigned long wg_data)
+/*
+ * Update both lines with a single call, which the gpio core turns into
+ * one set_multiple() on the controller when they share a bank. 0 pulls a
+ * line low, 1 releases it.
+ */
+static void wiegand_out_set_lines(struct wiegand_out_dev *wiegand_out, int data0, int data1)
 {
-    unsigned char i, even_val = 0;
-    unsigned char ret;
-    
-    for (i = 12; i < 24; i++) {
-        if (((wg_data >> i) & 0x01) == 0x01) {
-            even_val++;
-        }
-    }
-    if ((even_val % 2) == 0) {
-        ret = 1;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+    unsigned long values = 0;
+
+    __assign_bit(WIEGAND_OUT_DATA0, &values, data0);
+    __assign_bit(WIEGAND_OUT_DATA1, &values, data1);
+    if (wiegand_out->cansleep) {
+        gpiod_set_raw_array_value_cansleep(ARRAY_SIZE(wiegand_out->lines), wiegand_out->lines,
+                                           NULL, &values);
     } else {
-        ret = 0;
+        gpiod_set_raw_array_value(ARRAY_SIZE(wiegand_out->lines), wiegand_out->lines, NULL, &values);
     }
+#else
+    int values[2];
 
-    return ret;
-}
-
-static unsigned char even_parity_26(unsigned long wg_data)
-{
-    unsigned char i, odd_val = 0;
-    unsigned char ret;
-
-    for (i = 0; i < 12; i++) {
-        if (((wg_data >> i) & 0x01) == 0x01) {
-            odd_val++;
-        }
-    }
-    if ((odd_val % 2) == 0) {
-        ret = 0;
+    values[WIEGAND_OUT_DATA0] = data0;
+    values[WIEGAND_OUT_DATA1] = data1;
+    if (wiegand_out->cansleep) {
+        gpiod_set_raw_array_value_cansleep(ARRAY_SIZE(wiegand_out->lines), wiegand_out->lines, values);
     } else {
-        ret = 1;
+        gpiod_set_raw_array_value(ARRAY_SIZE(wiegand_out->lines), wiegand_out->lines, values);
     }
-
-    return ret;
+#endif
 }
 
-static unsigned char odd_parity_34(unsigned long long wg_data)
+static int wiegand_out_get_line(struct wiegand_out_dev *wiegand_out, int line)
 {
-    unsigned char i, even_val = 0;
-    unsigned char ret;
-
-    for (i = 16; i < 32; i++) {
-        if (((wg_data >> i) & 0x01) == 0x01) {
-            even_val++;
-        }
+    if (wiegand_out->cansleep) {
+        return gpiod_get_raw_value_cansleep(wiegand_out->lines[line]);
     }
-    if ((even_val % 2) == 0) {
-        ret = 1;
-    } else {
-        ret = 0;
-    }
-
-    return ret;
+    return gpiod_get_raw_value(wiegand_out->lines[line]);
 }
 
-static unsigned char even_parity_34(unsigned long long wg_data)
+/* Make both lines idle outputs, the hot path only changes their values */
+static void wiegand_out_lines_init(struct wiegand_out_dev *wiegand_out)
 {
-    unsigned char i, odd_val = 0;
-    unsigned char ret;
-    for (i = 0; i < 16; i++) {
-        if (((wg_data >> i) & 0x01) == 0x01) {
-            odd_val++;
-        }
-    }
-    if ((odd_val % 2) == 0) {
-        ret = 0;
-    } else {
-        ret = 1;
-    }
-
-    return ret;
+    gpiod_direction_output_raw(wiegand_out->lines[WIEGAND_OUT_DATA0], 1);
+    gpiod_direction_output_raw(wiegand_out->lines[WIEGAND_OUT_DATA1], 1);
 }
 
 static void wiegand_out_data_reset(struct wiegand_out_dev *wiegand_out)
 {
-    gpio_direction_output(wiegand_out->data0_pin, 1);
-    gpio_direction_output(wiegand_out->data1_pin, 1);
+    wiegand_out_set_lines(wiegand_out, 1, 1);
 }
 
 static void wiegand_out_set_start_state(struct wiegand_out_dev *wiegand_out)
@@ -182,122 +188,346 @@ static void wiegand_out_set_current_state(struct wiegand_out_dev *wiegand_out)
     wiegand_out->state = (wiegand_out->state == PLUSE_WIDTH_STATE) ? PLUSE_INTVAL_STATE : PLUSE_WIDTH_STATE;
 }
 
+/* The timer rearms itself, pinned it stays on the CPU the frame started on */
+static enum hrtimer_mode wiegand_out_timer_mode(struct wiegand_out_dev *wiegand_out)
+{
+    return READ_ONCE(wiegand_out->cpu) >= 0 ? HRTIMER_MODE_REL_PINNED : HRTIMER_MODE_REL;
+}
+
 static void wiegand_out_start_pulse_width_timer(struct wiegand_out_dev *wiegand_out)
 {
-    int us = wiegand_out->pulse_width;
+    int us = wiegand_out->frame_cfg.pulse_width;
     int s = us / 1000000;
     ktime_t time = ktime_set(s, (us % 1000000) * 1000);
-    hrtimer_start(&wiegand_out->timer, time, HRTIMER_MODE_REL);
+    hrtimer_start(&wiegand_out->timer, time, wiegand_out_timer_mode(wiegand_out));
 }
 
 static void wiegand_out_start_pulse_intval_timer(struct wiegand_out_dev *wiegand_out)
 {
-    int us = wiegand_out->pulse_intval;
+    int us = wiegand_out->frame_cfg.pulse_intval;
     int s = us / 1000000;
     ktime_t time = ktime_set(s, (us % 1000000) * 1000);
-    hrtimer_start(&wiegand_out->timer, time, HRTIMER_MODE_REL);
+    hrtimer_start(&wiegand_out->timer, time, wiegand_out_timer_mode(wiegand_out));
 }
 
-static void wiegand_out_start_write(struct wiegand_out_dev *wiegand_out)
+static void wiegand_out_start_frame(void *info)
 {
+    struct wiegand_out_dev *wiegand_out = info;
+
     wiegand_out->pos = 0;
+    trace_wiegand_out_frame_start(wiegand_out->port, wiegand_out->frame_cfg.format,
+                                  wiegand_out->wiegand_out_data[0],
+                                  wiegand_out->wiegand_out_data[1]);
     wiegand_out_set_start_state(wiegand_out);
     wiegand_out_data_reset(wiegand_out);
-    hrtimer_start(&wiegand_out->timer, ktime_set(0, 0), HRTIMER_MODE_REL);
+    hrtimer_start(&wiegand_out->timer, ktime_set(0, 0), wiegand_out_timer_mode(wiegand_out));
 }
 
-static int wiegand_out_add_parity_bits(struct wiegand_out_dev *wiegand_out)
+static void wiegand_out_start_write(struct wiegand_out_dev *wiegand_out)
 {
-    unsigned long data = 0;
-    unsigned int tmp[MAX_WIEGAND_DATA_LEN] = {0x00, 0x00};
+    int cpu = READ_ONCE(wiegand_out->cpu);
 
-    if (wiegand_out->data_length == WIEGAND_MODE_26) {
-        data = wiegand_out->wiegand_data & 0xffffff;
+    if (wiegand_out->cansleep) {
+        queue_work_on(cpu >= 0 && cpu_online(cpu) ? cpu : WORK_CPU_UNBOUND,
+                      wiegand_out->tx_wq, &wiegand_out->tx_work);
+        return;
+    }
+    /* Start the frame on wiegand,cpu so the pinned timer runs there */
+    if (cpu < 0 || smp_call_function_single(cpu, wiegand_out_start_frame, wiegand_out, 1)) {
+        wiegand_out_start_frame(wiegand_out);
+    }
+}
 
-        // First 12 bits even parity
-        if (even_parity_26(data)) {
-            data = 0x01000000 | data;
-        } else {
-            data = 0x00ffffff & data;
-        }
+static bool wiegand_out_config_valid(const struct wiegand_config *cfg)
+{
+    return cfg->format >= 1 && cfg->format <= 64 &&
+           cfg->pulse_width > 0 && cfg->pulse_width <= USEC_PER_SEC &&
+           cfg->pulse_intval > 0 && cfg->pulse_intval <= USEC_PER_SEC;
+}
 
-        // After 12 bits odd parity
-        if (odd_parity_26(data)) {
-            data = (data << 1) | 0x00000001;
-        } else {
-            data = (data << 1) & 0x01fffffe;
-        }
-        
-        tmp[0] = data << 6;
-        tmp[1] = 0x00;
-
-        // Use data with parity bits
-        memcpy(wiegand_out->wiegand_out_data, tmp, sizeof(wiegand_out->wiegand_out_data));
-    } else if (wiegand_out->data_length == WIEGAND_MODE_34) {
-        data = wiegand_out->wiegand_data;
-
-        // First 16 bits even parity
-        if (even_parity_34(data)) {
-            tmp[0] = (data >> 1) | 0x80000000;
-        } else {
-            tmp[0] = (data >> 1) & 0x7fffffff;
-        }
+static void wiegand_out_config_get(struct wiegand_out_dev *wiegand_out, struct wiegand_config *cfg)
+{
+    rcu_read_lock();
+    *cfg = rcu_dereference(wiegand_out->profile)->cfg;
+    rcu_read_unlock();
+}
+
+/*
+ * Replace the profile with a copy of cfg, called with config_lock held.
+ * A frame already claimed keeps the profile it was claimed with.
+ */
+static int wiegand_out_config_publish(struct wiegand_out_dev *wiegand_out,
+                                      const struct wiegand_config *cfg)
+{
+    struct wiegand_out_profile *profile, *old;
+
+    if (!wiegand_out_config_valid(cfg)) {
+        return -EINVAL;
+    }
+    profile = kmalloc(sizeof(*profile), GFP_KERNEL);
+    if (!profile) {
+        return -ENOMEM;
+    }
+    profile->cfg = *cfg;
 
-        tmp[1] = (data & 0x00000001) << 31;
+    old = rcu_dereference_protected(wiegand_out->profile,
+                                    lockdep_is_held(&wiegand_out->config_lock));
+    rcu_assign_pointer(wiegand_out->profile, profile);
+    if (old) {
+        kfree_rcu(old, rcu);
+    }
+    return 0;
+}
 
-        // After 16 bits odd parity
-        if (odd_parity_34(data)) {
-            tmp[1] |= 0x40000000;
-        } else {
-            tmp[1] &= 0xbfffffff;
+/* Update the __u32 at offset in struct wiegand_config, keeping the others */
+static int wiegand_out_config_field(struct wiegand_out_dev *wiegand_out, size_t offset, u32 value)
+{
+    struct wiegand_config cfg;
+    int ret;
+
+    mutex_lock(&wiegand_out->config_lock);
+    cfg = rcu_dereference_protected(wiegand_out->profile,
+                                    lockdep_is_held(&wiegand_out->config_lock))->cfg;
+    *(u32 *)((char *)&cfg + offset) = value;
+    ret = wiegand_out_config_publish(wiegand_out, &cfg);
+    mutex_unlock(&wiegand_out->config_lock);
+    return ret;
+}
+
+/* Called once the transmitter is claimed, the frame is sent with this profile */
+static void wiegand_out_frame_begin(struct wiegand_out_dev *wiegand_out)
+{
+    wiegand_out_config_get(wiegand_out, &wiegand_out->frame_cfg);
+}
+
+static bool wiegand_out_try_claim(struct wiegand_out_dev *wiegand_out)
+{
+    unsigned long flags;
+    bool claimed = false;
+
+    spin_lock_irqsave(&wiegand_out->lock, flags);
+    if (!wiegand_out->busy) {
+        wiegand_out->busy = true;
+        claimed = true;
+    }
+    spin_unlock_irqrestore(&wiegand_out->lock, flags);
+    return claimed;
+}
+
+/* Claim the transmitter, waiting for it to be idle unless nonblock */
+static int wiegand_out_claim(struct wiegand_out_dev *wiegand_out, bool nonblock)
+{
+    while (!wiegand_out_try_claim(wiegand_out)) {
+        if (nonblock) {
+            return -EAGAIN;
         }
+        if (wait_event_interruptible(wiegand_out->wq, !wiegand_out->busy)) {
+            return -ERESTARTSYS;
+        }
+    }
+    return 0;
+}
 
-        // Use data with parity bits
-        memcpy(wiegand_out->wiegand_out_data, tmp, sizeof(wiegand_out->wiegand_out_data));
+static int wiegand_out_add_parity_bits(struct wiegand_out_dev *wiegand_out)
+{
+    int bits = wiegand_out->frame_cfg.format;
+    u64 frame;
+
+    if (bits == WIEGAND_MODE_26 || bits == WIEGAND_MODE_34) {
+        /* Left aligned, wiegand_out_get_bit() starts from the top bit */
+        frame = wiegand_parity_encode(wiegand_out->wiegand_data, bits) << (64 - bits);
+        wiegand_out->wiegand_out_data[0] = frame >> 32;
+        wiegand_out->wiegand_out_data[1] = (u32)frame;
     }
 
-    dev_info(wiegand_out->dev, "%s: parity: %08x%08x\n", __func__,
+    dev_dbg(wiegand_out->dev, "%s: parity: %08x%08x\n", __func__,
         wiegand_out->wiegand_out_data[0],
         wiegand_out->wiegand_out_data[1]);
     
     return 0;
 }
 
+/* A frame written to the hub, like WIEGAND_WRITE from a non-blocking fd */
+static int wiegand_out_hub_write(struct wiegand_hub_out *hub, u32 data)
+{
+    struct wiegand_out_dev *wiegand_out = container_of(hub, struct wiegand_out_dev, hub);
+
+    if (!wiegand_out_try_claim(wiegand_out)) {
+        return -EAGAIN;
+    }
+    wiegand_out_frame_begin(wiegand_out);
+    wiegand_out->wiegand_data = data;
+    dev_dbg(wiegand_out->dev, "%s: [%d] %08x\n", __func__,
+                wiegand_out->frame_cfg.format, wiegand_out->wiegand_data);
+
+    wiegand_out_add_parity_bits(wiegand_out);
+    wiegand_out_start_write(wiegand_out);
+    return 0;
+}
+
+static bool wiegand_out_hub_busy(struct wiegand_hub_out *hub)
+{
+    struct wiegand_out_dev *wiegand_out = container_of(hub, struct wiegand_out_dev, hub);
+
+    return READ_ONCE(wiegand_out->busy);
+}
+
+/* Only called from the bit hrtimer */
+#define wiegand_out_stats_inc(wiegand_out, field) do {                      \
+        struct wiegand_out_stats *__st = this_cpu_ptr((wiegand_out)->stats); \
+        u64_stats_update_begin(&__st->syncp);                               \
+        __st->field++;                                                      \
+        u64_stats_update_end(&__st->syncp);                                 \
+    } while (0)
+
+/* Also from tx_work, which runs preemptible */
+#define wiegand_out_stats_inc_any(wiegand_out, field) do {                  \
+        unsigned long __flags;                                              \
+        local_irq_save(__flags);                                            \
+        wiegand_out_stats_inc(wiegand_out, field);                          \
+        local_irq_restore(__flags);                                         \
+    } while (0)
+
+static void wiegand_out_stats_read(struct wiegand_out_dev *wiegand_out, struct wiegand_out_stats *total)
+{
+    int cpu;
+
+    memset(total, 0, sizeof(*total));
+
+    for_each_possible_cpu(cpu) {
+        struct wiegand_out_stats *st = per_cpu_ptr(wiegand_out->stats, cpu);
+        u64 frames_sent, late_edges, line_faults;
+        unsigned int start;
+
+        do {
+            start = u64_stats_fetch_begin(&st->syncp);
+            frames_sent = st->frames_sent;
+            late_edges = st->late_edges;
+            line_faults = st->line_faults;
+        } while (u64_stats_fetch_retry(&st->syncp, start));
+
+        total->frames_sent += frames_sent;
+        total->late_edges += late_edges;
+        total->line_faults += line_faults;
+    }
+}
+
+/*
+ * Both lines have been released for a whole interval, on controllers that
+ * read back the pad level a low one is held down on the bus.
+ */
+static void wiegand_out_check_lines(struct wiegand_out_dev *wiegand_out)
+{
+    bool fault = !wiegand_out_get_line(wiegand_out, WIEGAND_OUT_DATA0) ||
+                 !wiegand_out_get_line(wiegand_out, WIEGAND_OUT_DATA1);
+
+    if (fault && !wiegand_out->line_fault) {
+        wiegand_out_stats_inc_any(wiegand_out, line_faults);
+        dev_warn_ratelimited(wiegand_out->dev, "%s: data line held low\n", __func__);
+    }
+    WRITE_ONCE(wiegand_out->line_fault, fault);
+}
+
+static int wiegand_out_get_bit(struct wiegand_out_dev *wiegand_out, int pos)
+{
+    return !!(wiegand_out->wiegand_out_data[pos / 32] & (0x80000000 >> (pos % 32)));
+}
+
+/* The last interval is over, from the hrtimer or tx_work */
+static void wiegand_out_frame_done(struct wiegand_out_dev *wiegand_out)
+{
+    trace_wiegand_out_frame_end(wiegand_out->port, wiegand_out->frame_cfg.format,
+                                wiegand_out->wiegand_out_data[0],
+                                wiegand_out->wiegand_out_data[1]);
+    wiegand_out_stats_inc_any(wiegand_out, frames_sent);
+    wiegand_out_check_lines(wiegand_out);
+    wiegand_out->busy = false;
+    if (waitqueue_active(&wiegand_out->wq)) {
+        wake_up_interruptible(&wiegand_out->wq);
+    }
+    wiegand_hub_out_idle();
+}
+
 static enum hrtimer_restart wiegand_out_timeout(struct hrtimer *timer)
 {
-    int index = 0, offset = 0;
+    int bit;
     struct wiegand_out_dev *wiegand_out = container_of(timer, struct wiegand_out_dev, timer);
 
+    /* The first expiry of a frame is immediate and can't be late */
+    if (wiegand_out->pos > 0 &&
+        ktime_to_us(ktime_sub(ktime_get(), hrtimer_get_expires(timer))) > wiegand_out->frame_cfg.tolerance) {
+        wiegand_out_stats_inc(wiegand_out, late_edges);
+    }
+
     wiegand_out_set_current_state(wiegand_out);
 
     if (wiegand_out->state == PLUSE_WIDTH_STATE) {
-        if (wiegand_out->pos == wiegand_out->data_length) {
-            if (waitqueue_active(&wiegand_out->wq)) {
-                wake_up_interruptible(&wiegand_out->wq);
-            }
-
+        if (wiegand_out->pos == wiegand_out->frame_cfg.format) {
+            wiegand_out_frame_done(wiegand_out);
             return HRTIMER_NORESTART;
         }
 
-        index = wiegand_out->pos / 32;
-        offset = wiegand_out->pos % 32;
-        if (wiegand_out->wiegand_out_data[index] & (0x80000000 >> offset)) {
-            gpio_direction_output(wiegand_out->data1_pin, 0);
-        } else {
-            gpio_direction_output(wiegand_out->data0_pin, 0);
-        }
+        /* A 1 is a pulse on DATA1, a 0 one on DATA0 */
+        bit = wiegand_out_get_bit(wiegand_out, wiegand_out->pos);
+        wiegand_out_set_lines(wiegand_out, bit, !bit);
+        trace_wiegand_out_bit_start(wiegand_out->port, wiegand_out->pos, bit);
 
         wiegand_out->pos++;
         wiegand_out_start_pulse_width_timer(wiegand_out);
     } else {
-        gpio_direction_output(wiegand_out->data0_pin, 1);
-        gpio_direction_output(wiegand_out->data1_pin, 1);
+        wiegand_out_set_lines(wiegand_out, 1, 1);
+        if (wiegand_out->pos > 0) {
+            trace_wiegand_out_bit_end(wiegand_out->port, wiegand_out->pos - 1,
+                                      wiegand_out_get_bit(wiegand_out, wiegand_out->pos - 1));
+        }
         wiegand_out_start_pulse_intval_timer(wiegand_out);
     }
 
     return HRTIMER_NORESTART;
 }
 
+/* Sleep to an absolute deadline, an edge past it by the tolerance is late */
+static void wiegand_out_tx_sleep(struct wiegand_out_dev *wiegand_out, ktime_t deadline)
+{
+    set_current_state(TASK_UNINTERRUPTIBLE);
+    schedule_hrtimeout_range(&deadline, 0, HRTIMER_MODE_ABS);
+    if (ktime_to_us(ktime_sub(ktime_get(), deadline)) > wiegand_out->frame_cfg.tolerance) {
+        wiegand_out_stats_inc_any(wiegand_out, late_edges);
+    }
+}
+
+/*
+ * Lines on a chip that sleeps, like gpio-sim or a bus expander, can't be
+ * driven from the hrtimer. The frame is sent from a high priority worker
+ * instead, with the same timing and absolute deadlines, so a late wakeup
+ * doesn't shift the rest of the frame.
+ */
+static void wiegand_out_tx_work(struct work_struct *work)
+{
+    struct wiegand_out_dev *wiegand_out = container_of(work, struct wiegand_out_dev, tx_work);
+    ktime_t deadline;
+    int bit;
+
+    trace_wiegand_out_frame_start(wiegand_out->port, wiegand_out->frame_cfg.format,
+                                  wiegand_out->wiegand_out_data[0],
+                                  wiegand_out->wiegand_out_data[1]);
+    wiegand_out_data_reset(wiegand_out);
+    deadline = ktime_get();
+    for (wiegand_out->pos = 0; wiegand_out->pos < wiegand_out->frame_cfg.format; wiegand_out->pos++) {
+        bit = wiegand_out_get_bit(wiegand_out, wiegand_out->pos);
+        wiegand_out_set_lines(wiegand_out, bit, !bit);
+        trace_wiegand_out_bit_start(wiegand_out->port, wiegand_out->pos, bit);
+        deadline = ktime_add_us(deadline, wiegand_out->frame_cfg.pulse_width);
+        wiegand_out_tx_sleep(wiegand_out, deadline);
+
+        wiegand_out_set_lines(wiegand_out, 1, 1);
+        trace_wiegand_out_bit_end(wiegand_out->port, wiegand_out->pos, bit);
+        deadline = ktime_add_us(deadline, wiegand_out->frame_cfg.pulse_intval);
+        wiegand_out_tx_sleep(wiegand_out, deadline);
+    }
+    wiegand_out_frame_done(wiegand_out);
+}
+
 static int wiegand_out_open(struct inode *inode, struct file *filp)
 {
     struct miscdevice *dev = filp->private_data;
@@ -309,9 +539,16 @@ static int wiegand_out_open(struct inode *inode, struct file *filp)
         return -EBUSY;
     }
     wiegand_out->use_count++;
+    /*
+     * The lines are left idle by probe and by every frame, and the hub may
+     * have one on the wire right now, so they are not touched here. A fault
+     * is forgotten, the next frame checks the lines again.
+     */
+    if (!wiegand_out->busy) {
+        wiegand_out->line_fault = false;
+    }
     spin_unlock(&wiegand_out->lock);
 
-    wiegand_out_data_reset(wiegand_out);
     return 0;
 }
 
@@ -327,44 +564,87 @@ static int wiegand_out_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-static ssize_t wiegand_out_write(struct file *filp, const char __user *buf, size_t size, loff_t *l)
+static bool wiegand_out_nonblock(struct kiocb *iocb)
+{
+#ifdef IOCB_NOWAIT
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        return true;
+    }
+#endif
+    return iocb->ki_filp->f_flags & O_NONBLOCK;
+}
+
+/*
+ * Sends the raw bits, first bit in the MSB of the first word. Blocking
+ * writes return once the frame is on the wire, non-blocking ones as soon
+ * as it is started, poll for POLLOUT before the next one.
+ */
+static ssize_t wiegand_out_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
     int ret, us, s;
-    struct miscdevice *dev = filp->private_data;
+    struct miscdevice *dev = iocb->ki_filp->private_data;
     struct wiegand_out_dev *wiegand_out = container_of(dev, struct wiegand_out_dev, mdev);
+    size_t size = iov_iter_count(from);
+    bool nonblock = wiegand_out_nonblock(iocb);
+    unsigned int data[MAX_WIEGAND_DATA_LEN] = {0x00, 0x00};
 
-    if (filp->f_flags & O_NONBLOCK) {
-        return -EAGAIN;
+    if (size == 0 || size > sizeof(wiegand_out->wiegand_out_data)) {
+        dev_err(wiegand_out->dev, "ERROR: wiegand out data length error, max is %zu bytes, please check.\n",
+                sizeof(wiegand_out->wiegand_out_data));
+        return -EINVAL;
     }
-
-    if (size > MAX_WIEGAND_DATA_LEN) {
-        dev_err(wiegand_out->dev, "ERROR: wiegand out data length error, max is %d, please check.\n", MAX_WIEGAND_DATA_LEN);
+    if (copy_from_iter(data, size, from) != size) {
         return -EFAULT;
     }
 
-    if (copy_from_user(wiegand_out->wiegand_out_data, buf, size)) {
-        return -EFAULT;
+    ret = wiegand_out_claim(wiegand_out, nonblock);
+    if (ret) {
+        return ret;
     }
+    wiegand_out_frame_begin(wiegand_out);
+    memcpy(wiegand_out->wiegand_out_data, data, sizeof(data));
+    us = (wiegand_out->frame_cfg.pulse_width + wiegand_out->frame_cfg.pulse_intval)
+         * wiegand_out->frame_cfg.format;
 
-    dev_info(wiegand_out->dev, "%s:[%d] %08x%08x\n", __func__,
-                            wiegand_out->data_length,
+    dev_dbg(wiegand_out->dev, "%s:[%d] %08x%08x\n", __func__,
+                            wiegand_out->frame_cfg.format,
                             wiegand_out->wiegand_out_data[0],
                             wiegand_out->wiegand_out_data[1]);
 
     wiegand_out_start_write(wiegand_out);
+    if (nonblock) {
+        return size;
+    }
 
-    us = (wiegand_out->pulse_width + wiegand_out->pulse_intval)
-         * wiegand_out->data_length;
     s = us / 1000000;
 
     //ret = interruptible_sleep_on_timeout(&wiegand_out->wq, (s + 2) * HZ);
-    ret = wait_event_interruptible_timeout(wiegand_out->wq, !waitqueue_active(&wiegand_out->wq), (s + 2) * HZ);
+    ret = wait_event_interruptible_timeout(wiegand_out->wq, !wiegand_out->busy, (s + 2) * HZ);
     if (!ret) {
         dev_err(wiegand_out->dev, "wiegand write timeout\n");
         return -EIO;
     }
 
-    return 0;
+    /* Interrupted or not, the frame is out, restarting would send it twice */
+    return size;
+}
+
+static unsigned int wiegand_out_poll(struct file *filp, poll_table *wait)
+{
+    unsigned int mask = 0;
+
+    struct miscdevice *dev = filp->private_data;
+    struct wiegand_out_dev *wiegand_out = container_of(dev, struct wiegand_out_dev, mdev);
+    poll_wait(filp, &wiegand_out->wq, wait);
+
+    if (!READ_ONCE(wiegand_out->busy)) {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+    if (READ_ONCE(wiegand_out->line_fault)) {
+        mask |= POLLERR;
+    }
+
+    return mask;
 }
 
 static long wiegand_out_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
@@ -383,10 +663,8 @@ static long wiegand_out_ioctl(struct file *filp, unsigned int cmd, unsigned long
         return -EINVAL;
     }
 
-    if (_IOC_DIR(cmd) & _IOC_READ) {
-        ret = !access_ok(VERIFY_WRITE, (void *)arg, _IOC_SIZE(cmd));
-    } else if (_IOC_DIR(cmd) & _IOC_WRITE) {
-        ret = !access_ok(VERIFY_READ, (void *)arg, _IOC_SIZE(cmd));
+    if (_IOC_DIR(cmd) & (_IOC_READ | _IOC_WRITE)) {
+        ret = !wiegand_access_ok((void __user *)arg, _IOC_SIZE(cmd));
     }
     if (ret) {
         dev_err(wiegand_out->dev, "%s, verify r/w failed.", __func__);
@@ -398,39 +676,67 @@ static long wiegand_out_ioctl(struct file *filp, unsigned int cmd, unsigned long
                 if (get_user(cs, (unsigned int *)arg)) {
                     return -EINVAL;
                 }
-                wiegand_out->pulse_width = cs;
                 dev_info(wiegand_out->dev, "%s: WIEGAND_PULSE_WIDTH pulse_width=%d\n", 
-                    __func__, wiegand_out->pulse_width);
-                break;
+                    __func__, cs);
+                return wiegand_out_config_field(wiegand_out,
+                                                offsetof(struct wiegand_config, pulse_width), cs);
             }
 
         case WIEGAND_PULSE_INTERVAL: {
                 if (get_user(cs, (unsigned int *)arg)) {
                     return -EINVAL;
                 }
-                wiegand_out->pulse_intval = cs;
                 dev_info(wiegand_out->dev, "%s: WIEGAND_PULSE_INTERVAL pulse_intval=%d\n", 
-                    __func__, wiegand_out->pulse_intval);
-                break;
+                    __func__, cs);
+                return wiegand_out_config_field(wiegand_out,
+                                                offsetof(struct wiegand_config, pulse_intval), cs);
             }
 
         case WIEGAND_FORMAT: {
                 if (get_user(cs, (unsigned int *)arg)) {
                     return -EINVAL;
                 }
-                wiegand_out->data_length = cs;
                 dev_info(wiegand_out->dev, "%s: WIEGAND_FORMAT data_length=%d\n", 
-                    __func__, wiegand_out->data_length);
+                    __func__, cs);
+                return wiegand_out_config_field(wiegand_out,
+                                                offsetof(struct wiegand_config, format), cs);
+            }
+
+        case WIEGAND_GET_CONFIG: {
+                struct wiegand_config cfg;
+
+                wiegand_out_config_get(wiegand_out, &cfg);
+                if (copy_to_user((void __user *)arg, &cfg, sizeof(cfg))) {
+                    return -EFAULT;
+                }
                 break;
             }
 
+        case WIEGAND_SET_CONFIG: {
+                struct wiegand_config cfg;
+
+                if (copy_from_user(&cfg, (void __user *)arg, sizeof(cfg))) {
+                    return -EFAULT;
+                }
+                mutex_lock(&wiegand_out->config_lock);
+                ret = wiegand_out_config_publish(wiegand_out, &cfg);
+                mutex_unlock(&wiegand_out->config_lock);
+                return ret;
+            }
+
         case WIEGAND_WRITE: {
                 if (get_user(cs, (unsigned int *)arg)) {
                     return -EINVAL;
                 }
+                /* Frames are sent back to back, never on top of each other */
+                ret = wiegand_out_claim(wiegand_out, filp->f_flags & O_NONBLOCK);
+                if (ret) {
+                    return ret;
+                }
+                wiegand_out_frame_begin(wiegand_out);
                 wiegand_out->wiegand_data = cs;
-                dev_info(wiegand_out->dev, "%s: WIEGAND_WRITE[%d] %08x\n", __func__,
-                            wiegand_out->data_length,
+                dev_dbg(wiegand_out->dev, "%s: WIEGAND_WRITE[%d] %08x\n", __func__,
+                            wiegand_out->frame_cfg.format,
                             wiegand_out->wiegand_data);
                                    
                 wiegand_out_add_parity_bits(wiegand_out);
@@ -438,6 +744,13 @@ static long wiegand_out_ioctl(struct file *filp, unsigned int cmd, unsigned long
                 break;
             }
 
+        case WIEGAND_GET_VERSION: {
+                if (put_user(WIEGAND_UAPI_VERSION, (__u32 *)arg)) {
+                    return -EFAULT;
+                }
+                break;
+            }
+
         default:
             return -EINVAL;
     }
@@ -445,7 +758,8 @@ static long wiegand_out_ioctl(struct file *filp, unsigned int cmd, unsigned long
     return 0;
 }
 
-static int wiegand_out_parse_dt(struct device *dev, struct wiegand_out_dev *wiegand)
+static int wiegand_out_parse_dt(struct device *dev, struct wiegand_out_dev *wiegand,
+                                struct wiegand_config *cfg)
 {
     int ret = 0;
     struct device_node *np = dev->of_node;
@@ -462,23 +776,25 @@ static int wiegand_out_parse_dt(struct device *dev, struct wiegand_out_dev *wieg
         return -1;
     }
 
-    ret = of_property_read_u32(np, "wiegand,data_length", &wiegand->data_length);
-    if (ret) {
-        wiegand->data_length = DEF_DATA_LENGTH;
-    }
-
-    ret = of_property_read_u32(np, "wiegand,pulse_width", &wiegand->pulse_width);
+    ret = of_property_read_u32(np, "wiegand,port", &wiegand->port);
     if (ret) {
-        wiegand->pulse_width = DEF_PULSE_WIDTH;
+        wiegand->port = 0;
     }
 
-    ret = of_property_read_u32(np, "wiegand,pulse_intval", &wiegand->pulse_intval);
-    if (ret) {
-        wiegand->pulse_intval = DEF_PULSE_INTERVAL;
+    /* Absent properties leave the defaults in cfg */
+    of_property_read_u32(np, "wiegand,data_length", &cfg->format);
+    of_property_read_u32(np, "wiegand,pulse_width", &cfg->pulse_width);
+    of_property_read_u32(np, "wiegand,pulse_intval", &cfg->pulse_intval);
+    of_property_read_u32(np, "wiegand,tolerance", &cfg->tolerance);
+    of_property_read_u32(np, "wiegand,cpu", &wiegand->cpu);
+    if (wiegand->cpu >= (int)nr_cpu_ids || (wiegand->cpu >= 0 && !cpu_possible(wiegand->cpu))) {
+        dev_warn(dev, "%s: No cpu %d, not pinning.\n", __func__, wiegand->cpu);
+        wiegand->cpu = -1;
     }
 
-    dev_info(dev, "%s: data_length=%d pulse_width=%d pulse_intval=%d\n", __func__,
-             wiegand->data_length, wiegand->pulse_width, wiegand->pulse_intval);
+    dev_info(dev, "%s: port=%d data_length=%u pulse_width=%u pulse_intval=%u tolerance=%u\n",
+             __func__, wiegand->port, cfg->format, cfg->pulse_width, cfg->pulse_intval,
+             cfg->tolerance);
 
     return 0;
 }
@@ -494,7 +810,7 @@ static int wiegand_in_request_io_port(struct wiegand_out_dev *wiegand_out)
             dev_err(&wiegand_out->platform_dev->dev, "Failed to request GPIO:%d, ERRNO:%d\n", (s32)wiegand_out->data0_pin, ret);
             return -ENODEV;
         }
-        gpio_direction_input(wiegand_out->data0_pin);
+        wiegand_out->lines[WIEGAND_OUT_DATA0] = gpio_to_desc(wiegand_out->data0_pin);
         dev_info(&wiegand_out->platform_dev->dev, "Success request data0 gpio\n");
     }
 
@@ -505,7 +821,7 @@ static int wiegand_in_request_io_port(struct wiegand_out_dev *wiegand_out)
             dev_err(&wiegand_out->platform_dev->dev, "Failed to request GPIO:%d, ERRNO:%d\n", (s32)wiegand_out->data1_pin, ret);
             return -ENODEV;
         }
-        gpio_direction_input(wiegand_out->data1_pin);
+        wiegand_out->lines[WIEGAND_OUT_DATA1] = gpio_to_desc(wiegand_out->data1_pin);
         dev_info(&wiegand_out->platform_dev->dev, "Success request data1 gpio\n");
     }
 
@@ -515,31 +831,148 @@ static int wiegand_in_request_io_port(struct wiegand_out_dev *wiegand_out)
 static struct file_operations wiegand_out_misc_fops = {
     .open       = wiegand_out_open,
     .release    = wiegand_out_release,
-    .write      = wiegand_out_write,
+    .write_iter = wiegand_out_write_iter,
     .unlocked_ioctl = wiegand_out_ioctl,
+    .poll       = wiegand_out_poll,
+};
+
+static struct wiegand_out_dev *wiegand_out_from_device(struct device *dev)
+{
+    struct miscdevice *mdev = dev_get_drvdata(dev);
+
+    return container_of(mdev, struct wiegand_out_dev, mdev);
+}
+
+static ssize_t frames_sent_show(struct device *dev,
+                                struct device_attribute *attr, char *buf)
+{
+    struct wiegand_out_stats total;
+
+    wiegand_out_stats_read(wiegand_out_from_device(dev), &total);
+    return sprintf(buf, "%llu\n", total.frames_sent);
+}
+static DEVICE_ATTR_RO(frames_sent);
+
+static ssize_t late_edges_show(struct device *dev,
+                               struct device_attribute *attr, char *buf)
+{
+    struct wiegand_out_stats total;
+
+    wiegand_out_stats_read(wiegand_out_from_device(dev), &total);
+    return sprintf(buf, "%llu\n", total.late_edges);
+}
+static DEVICE_ATTR_RO(late_edges);
+
+static ssize_t line_faults_show(struct device *dev,
+                                struct device_attribute *attr, char *buf)
+{
+    struct wiegand_out_stats total;
+
+    wiegand_out_stats_read(wiegand_out_from_device(dev), &total);
+    return sprintf(buf, "%llu\n", total.line_faults);
+}
+static DEVICE_ATTR_RO(line_faults);
+
+static struct attribute *wiegand_out_stats_attrs[] = {
+    &dev_attr_frames_sent.attr,
+    &dev_attr_late_edges.attr,
+    &dev_attr_line_faults.attr,
+    NULL,
+};
+
+/* /sys/class/misc/wiegand_outN/statistics/ */
+static const struct attribute_group wiegand_out_stats_group = {
+    .name = "statistics",
+    .attrs = wiegand_out_stats_attrs,
+};
+
+static ssize_t wiegand_out_cpu_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%d\n", READ_ONCE(wiegand_out_from_device(dev)->cpu));
+}
+
+/* Applied from the next frame, -1 lets the timer run anywhere */
+static ssize_t wiegand_out_cpu_store(struct device *dev, struct device_attribute *attr,
+                                     const char *buf, size_t count)
+{
+    int cpu, ret;
+
+    ret = kstrtoint(buf, 0, &cpu);
+    if (ret) {
+        return ret;
+    }
+    if (cpu < -1 || (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu)))) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(wiegand_out_from_device(dev)->cpu, cpu);
+    return count;
+}
+
+static struct device_attribute dev_attr_cpu =
+    __ATTR(cpu, 0644, wiegand_out_cpu_show, wiegand_out_cpu_store);
+
+static struct attribute *wiegand_out_attrs[] = {
+    &dev_attr_cpu.attr,
+    NULL,
+};
+
+/* /sys/class/misc/wiegand_outN/ */
+static const struct attribute_group wiegand_out_group = {
+    .attrs = wiegand_out_attrs,
+};
+
+static const struct attribute_group *wiegand_out_groups[] = {
+    &wiegand_out_group,
+    &wiegand_out_stats_group,
+    NULL,
 };
 
 static int wiegand_out_probe(struct platform_device *pdev)
 {
-    int ret = -1;
+    int ret = -1, cpu;
     struct wiegand_out_dev *wiegand_out;
+    struct wiegand_config cfg = {
+        .format = DEF_DATA_LENGTH,
+        .pulse_width = DEF_PULSE_WIDTH,
+        .pulse_intval = DEF_PULSE_INTERVAL,
+        .tolerance = DEVIATION,
+    };
 
     dev_info(&pdev->dev, "%s: WIEGAND OUT VERSION = %s\n", __func__, WIEGANDOUTDRV_LIB_VERSION);
 
     wiegand_out = kzalloc(sizeof(struct wiegand_out_dev), GFP_KERNEL);
     if (!wiegand_out) {
         printk("%s: alloc mem failed.\n", __FUNCTION__);
+        return -ENOMEM;
+    }
+
+    wiegand_out->stats = alloc_percpu(struct wiegand_out_stats);
+    if (!wiegand_out->stats) {
         ret = -ENOMEM;
+        goto exit_free_data;
+    }
+    for_each_possible_cpu(cpu) {
+        u64_stats_init(&per_cpu_ptr(wiegand_out->stats, cpu)->syncp);
     }
 
+    wiegand_out->cpu = -1;
     if (pdev->dev.of_node) {
-        ret = wiegand_out_parse_dt(&pdev->dev, wiegand_out);
+        ret = wiegand_out_parse_dt(&pdev->dev, wiegand_out, &cfg);
         if (ret) {
             dev_err(&pdev->dev, "%s: Failed parse dts.\n", __func__);
             goto exit_free_data;
         }
     }
 
+    mutex_init(&wiegand_out->config_lock);
+    mutex_lock(&wiegand_out->config_lock);
+    ret = wiegand_out_config_publish(wiegand_out, &cfg);
+    mutex_unlock(&wiegand_out->config_lock);
+    if (ret) {
+        dev_err(&pdev->dev, "%s: Invalid format or timing.\n", __func__);
+        goto exit_free_data;
+    }
+
     wiegand_out->platform_dev = pdev;
 
     ret = wiegand_in_request_io_port(wiegand_out);
@@ -547,33 +980,59 @@ static int wiegand_out_probe(struct platform_device *pdev)
         dev_err(&pdev->dev, "%s: Failed request IO port.\n", __func__);
         goto exit_free_data;
     }
+    wiegand_out->cansleep = gpiod_cansleep(wiegand_out->lines[WIEGAND_OUT_DATA0]) ||
+                            gpiod_cansleep(wiegand_out->lines[WIEGAND_OUT_DATA1]);
 
     wiegand_out->dev = &pdev->dev;
     wiegand_out->mdev.minor = MISC_DYNAMIC_MINOR;
-    wiegand_out->mdev.name =  "wiegand_out";
+    /* Port 0 keeps the legacy node name, further ports are numbered */
+    if (wiegand_out->port > 0) {
+        snprintf(wiegand_out->name, sizeof(wiegand_out->name), "%s%d", WIEGAND_DEIVCE_NAME, wiegand_out->port);
+    } else {
+        snprintf(wiegand_out->name, sizeof(wiegand_out->name), "%s", WIEGAND_DEIVCE_NAME);
+    }
+    wiegand_out->mdev.name = wiegand_out->name;
     wiegand_out->mdev.fops = &wiegand_out_misc_fops;
+    wiegand_out->mdev.groups = wiegand_out_groups;
 
-    wiegand_out_data_reset(wiegand_out);
-    wiegand_out->pulse_width = DEF_PULSE_WIDTH;
-    wiegand_out->pulse_intval = DEF_PULSE_INTERVAL;
-    wiegand_out->data_length = DEF_DATA_LENGTH;
+    wiegand_out_lines_init(wiegand_out);
 
     spin_lock_init(&wiegand_out->lock);
     init_waitqueue_head(&wiegand_out->wq);
     hrtimer_init(&wiegand_out->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
     wiegand_out->timer.function = wiegand_out_timeout;
+    INIT_WORK(&wiegand_out->tx_work, wiegand_out_tx_work);
+    if (wiegand_out->cansleep) {
+        /* Per-CPU so it can follow wiegand,cpu */
+        wiegand_out->tx_wq = alloc_workqueue("%s_tx", WQ_HIGHPRI, 1, wiegand_out->name);
+        if (!wiegand_out->tx_wq) {
+            ret = -ENOMEM;
+            goto exit_free_io_port;
+        }
+        dev_info(&pdev->dev, "%s: lines can sleep, sending from a worker.\n", __func__);
+    }
 
     ret = misc_register(&wiegand_out->mdev);
     if (ret < 0) {
         dev_err(&pdev->dev, "misc_register failed %s %s %d\n", __FILE__, __FUNCTION__, __LINE__);
-        goto exit_free_io_port;
+        goto exit_free_wq;
     }
 
     platform_set_drvdata(pdev, wiegand_out);
+
+    wiegand_out->hub.port = wiegand_out->port;
+    wiegand_out->hub.write = wiegand_out_hub_write;
+    wiegand_out->hub.busy = wiegand_out_hub_busy;
+    wiegand_hub_add_out(&wiegand_out->hub);
     dev_info(&pdev->dev, "%s: Weigand out driver register success.\n", __func__);
 
     return 0;
 
+exit_free_wq:
+    if (wiegand_out->tx_wq) {
+        destroy_workqueue(wiegand_out->tx_wq);
+    }
+
 exit_free_io_port:
     if (gpio_is_valid(wiegand_out->data0_pin)) {
         gpio_free(wiegand_out->data0_pin);
@@ -583,6 +1042,8 @@ exit_free_io_port:
     }
 
 exit_free_data:
+    kfree(rcu_dereference_protected(wiegand_out->profile, 1));
+    free_percpu(wiegand_out->stats);
     kfree(wiegand_out);
     return ret;
 }
@@ -590,9 +1051,17 @@ exit_free_data:
 static int wiegand_out_remove(struct platform_device *dev)
 {
     struct wiegand_out_dev *wiegand_out = platform_get_drvdata(dev);
+    wiegand_hub_del_out(&wiegand_out->hub);
     misc_deregister(&wiegand_out->mdev);
+    /* A frame the hub started may still be on the wire */
+    hrtimer_cancel(&wiegand_out->timer);
+    if (wiegand_out->tx_wq) {
+        destroy_workqueue(wiegand_out->tx_wq);
+    }
     gpio_free(wiegand_out->data0_pin);
     gpio_free(wiegand_out->data1_pin);
+    kfree(rcu_dereference_protected(wiegand_out->profile, 1));
+    free_percpu(wiegand_out->stats);
     kfree(wiegand_out);
 
     return 0;
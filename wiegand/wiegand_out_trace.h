@@ -0,0 +1,98 @@
+/*
+ * Copyright 2021 Bob Shen.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM wiegand_out
+
+#if !defined(_WIEGAND_OUT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _WIEGAND_OUT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(wiegand_out_frame_class,
+
+    TP_PROTO(int port, int bits, unsigned int raw0, unsigned int raw1),
+
+    TP_ARGS(port, bits, raw0, raw1),
+
+    TP_STRUCT__entry(
+        __field(int, port)
+        __field(int, bits)
+        __field(unsigned int, raw0)
+        __field(unsigned int, raw1)
+    ),
+
+    TP_fast_assign(
+        __entry->port = port;
+        __entry->bits = bits;
+        __entry->raw0 = raw0;
+        __entry->raw1 = raw1;
+    ),
+
+    TP_printk("port=%d bits=%d raw=%08x%08x",
+              __entry->port, __entry->bits, __entry->raw0, __entry->raw1)
+);
+
+DEFINE_EVENT(wiegand_out_frame_class, wiegand_out_frame_start,
+    TP_PROTO(int port, int bits, unsigned int raw0, unsigned int raw1),
+    TP_ARGS(port, bits, raw0, raw1)
+);
+
+DEFINE_EVENT(wiegand_out_frame_class, wiegand_out_frame_end,
+    TP_PROTO(int port, int bits, unsigned int raw0, unsigned int raw1),
+    TP_ARGS(port, bits, raw0, raw1)
+);
+
+DECLARE_EVENT_CLASS(wiegand_out_bit_class,
+
+    TP_PROTO(int port, int index, int bit),
+
+    TP_ARGS(port, index, bit),
+
+    TP_STRUCT__entry(
+        __field(int, port)
+        __field(int, index)
+        __field(int, bit)
+    ),
+
+    TP_fast_assign(
+        __entry->port = port;
+        __entry->index = index;
+        __entry->bit = bit;
+    ),
+
+    TP_printk("port=%d index=%d bit=%d", __entry->port, __entry->index, __entry->bit)
+);
+
+/* Data line pulled low */
+DEFINE_EVENT(wiegand_out_bit_class, wiegand_out_bit_start,
+    TP_PROTO(int port, int index, int bit),
+    TP_ARGS(port, index, bit)
+);
+
+/* Both lines back to idle */
+DEFINE_EVENT(wiegand_out_bit_class, wiegand_out_bit_end,
+    TP_PROTO(int port, int index, int bit),
+    TP_ARGS(port, index, bit)
+);
+
+#endif /* _WIEGAND_OUT_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE wiegand_out_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2021 Bob Shen.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parity bits of a Wiegand frame, shared by wiegand_in, wiegand_out and the
+ * userspace GPIO engine so the encoder and the decoders can't disagree.
+ *
+ * A frame of bits bits carries bits - 2 data bits. The first bit sent is
+ * the even parity of the first half of the data (its high bits), the last
+ * bit sent the odd parity of the second half. Frames are held right
+ * aligned, the first bit sent in bit bits - 1.
+ */
+
+#ifndef _WIEGAND_PARITY_H
+#define _WIEGAND_PARITY_H
+
+#include <linux/types.h>
+
+/* 1 when x has an odd number of bits set, no popcount for kernel builds */
+static inline unsigned int wiegand_parity64(__u64 x)
+{
+    x ^= x >> 32;
+    x ^= x >> 16;
+    x ^= x >> 8;
+    x ^= x >> 4;
+    x ^= x >> 2;
+    x ^= x >> 1;
+    return x & 1;
+}
+
+/* Only even lengths split in two halves, 4 to 64 bits */
+static inline int wiegand_parity_length_valid(int bits)
+{
+    return bits >= 4 && bits <= 64 && !(bits & 1);
+}
+
+/* The frame of data, bits long, bits valid */
+static inline __u64 wiegand_parity_encode(__u64 data, int bits)
+{
+    int half = (bits - 2) / 2;
+    __u64 mask = (1ULL << half) - 1;
+    __u64 frame;
+
+    data &= (mask << half) | mask;
+    frame = data << 1;
+    if (wiegand_parity64((data >> half) & mask)) {
+        frame |= 1ULL << (bits - 1);
+    }
+    if (!wiegand_parity64(data & mask)) {
+        frame |= 1;
+    }
+    return frame;
+}
+
+/* The data bits of a frame */
+static inline __u64 wiegand_parity_strip(__u64 frame, int bits)
+{
+    return (frame >> 1) & ((1ULL << (bits - 2)) - 1);
+}
+
+/* 0 when both parity bits of a frame, bits valid, are right */
+static inline int wiegand_parity_check(__u64 frame, int bits)
+{
+    int half = (bits - 2) / 2;
+    __u64 mask = (1ULL << half) - 1;
+
+    if (wiegand_parity64((frame >> (half + 1)) & mask) ^ ((frame >> (bits - 1)) & 1)) {
+        return -1;
+    }
+    if (!(wiegand_parity64((frame >> 1) & mask) ^ (frame & 1))) {
+        return -1;
+    }
+    return 0;
+}
+
+#endif /* _WIEGAND_PARITY_H */
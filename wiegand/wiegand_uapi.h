@@ -0,0 +1,190 @@
+/*
+ * Copyright 2021 Bob Shen.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Userspace interface of the wiegand_in and wiegand_out drivers, shared by
+ * the drivers, the HAL and libwiegand. Only append to it and bump
+ * WIEGAND_UAPI_VERSION when doing so.
+ */
+
+#ifndef _WIEGAND_UAPI_H
+#define _WIEGAND_UAPI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * 1: WIEGAND_PULSE_WIDTH .. WIEGAND_STATUS
+ * 2: struct wiegand_frame, WIEGAND_READ_FRAME(S), WIEGAND_GET_VERSION
+ * 3: struct wiegand_config, WIEGAND_GET_CONFIG, WIEGAND_SET_CONFIG
+ * 4: WIEGAND_FRAME_KEY, WIEGAND_FRAME_PIN
+ * 5: struct wiegand_coalesce, WIEGAND_GET_COALESCE, WIEGAND_SET_COALESCE
+ * 6: WIEGAND_HUB_DEVICE_NAME, struct wiegand_hub_frame, struct wiegand_hub_write,
+ *    struct wiegand_hub_ports, WIEGAND_HUB_GET_PORTS
+ * 7: struct wiegand_filter, struct wiegand_filter_data, WIEGAND_FILTER_*,
+ *    WIEGAND_FRAME_STATUS_MASK, WIEGAND_FRAME_TAG_SHIFT, WIEGAND_SET_FILTER
+ */
+#define WIEGAND_UAPI_VERSION    7
+
+/* Port 0 is /dev/wiegand_in, port N is /dev/wiegand_inN */
+#define WIEGAND_IN_DEVICE_NAME  "wiegand_in"
+#define WIEGAND_OUT_DEVICE_NAME "wiegand_out"
+/* All ports through one node, see struct wiegand_hub_frame and wiegand_hub_write */
+#define WIEGAND_HUB_DEVICE_NAME "wiegand_hub"
+
+#define WIEGAND_MODE_26     26 //bit
+#define WIEGAND_MODE_34     34 //bit
+
+/* wiegand_frame status */
+#define WIEGAND_FRAME_OK            0
+#define WIEGAND_FRAME_PARITY_ERROR  1
+#define WIEGAND_FRAME_LENGTH_ERROR  2
+/* Keypad ports only: a 4 or 8 bit key burst, data is the WIEGAND_KEY_* */
+#define WIEGAND_FRAME_KEY           3
+/* Keypad ports only: an assembled PIN, data holds its digits in BCD, bits is 4 per digit */
+#define WIEGAND_FRAME_PIN           4
+
+/*
+ * A WIEGAND_FILTER_TAG puts its tag in the high nibble of status, the low
+ * one is still the WIEGAND_FRAME_*. Frames are only tagged by a filter.
+ */
+#define WIEGAND_FRAME_STATUS_MASK   0x0f
+#define WIEGAND_FRAME_TAG_SHIFT     4
+
+/* Key codes of the 4 and 8 bit keypad formats, 0 to 9 are the digits */
+#define WIEGAND_KEY_STAR    10
+#define WIEGAND_KEY_HASH    11
+
+struct wiegand_frame {
+    __u64 timestamp_ns;     /* CLOCK_MONOTONIC time of the last edge */
+    __u32 raw[2];           /* received bits, the last one in bit 0 of raw[0] */
+    __u32 data;             /* card data without parity bits */
+    __u16 port;
+    __u8  bits;             /* received frame length */
+    __u8  status;           /* WIEGAND_FRAME_* */
+};
+
+struct wiegand_frames {
+    __u64 frames;           /* user pointer to count struct wiegand_frame */
+    __u32 count;
+    __u32 flags;            /* must be 0 */
+};
+
+/* Format and timing of a port, applied from the next frame on */
+struct wiegand_config {
+    __u32 format;           /* frame length in bits, 1 to 64 */
+    __u32 pulse_width;      /* us, at most 1s */
+    __u32 pulse_intval;     /* us, at most 1s */
+    __u32 tolerance;        /* us, accepted deviation of the edge timing */
+};
+
+/*
+ * When the readers of an open wiegand_in port are woken up: once frames
+ * are queued, or once usecs passed since the oldest of them was, whichever
+ * comes first. Reset to 1 frame, 0 us (every frame) on each open.
+ */
+struct wiegand_coalesce {
+    __u32 frames;           /* 1 to the fifo size, 16 */
+    __u32 usecs;            /* at most 1s, 0 only with frames 1 */
+};
+
+/*
+ * read() from the hub returns as many of these as fit, in the order the
+ * frames of all wiegand_in ports were queued. The hub only queues while it
+ * is open, seq is 1 for the first frame after open and a gap is frames
+ * dropped on a full hub fifo.
+ */
+struct wiegand_hub_frame {
+    __u64 seq;
+    struct wiegand_frame frame; /* frame.port is the wiegand_in port */
+};
+
+/* write() to the hub takes an array of these, each one is a WIEGAND_WRITE on its port */
+struct wiegand_hub_write {
+    __u32 data;
+    __u16 port;             /* wiegand_out port */
+    __u16 flags;            /* must be 0 */
+};
+
+/* Ports registered with the hub, bit n is port n */
+struct wiegand_hub_ports {
+    __u32 in;
+    __u32 out;
+};
+
+/*
+ * A classic BPF program (struct sock_filter, <linux/filter.h>) run on
+ * every frame a wiegand_in port decodes, before it is queued. It reads
+ * struct wiegand_filter_data with 32 bit absolute loads only, and returns
+ * a WIEGAND_FILTER_* action. len 0 detaches the filter of the port.
+ */
+struct wiegand_filter {
+    __u64 filter;           /* user pointer to len struct sock_filter */
+    __u32 len;              /* at most BPF_MAXINSNS */
+    __u32 flags;            /* must be 0 */
+};
+
+/* The input of a filter, like struct wiegand_frame, u64 fields in native byte order */
+struct wiegand_filter_data {
+    __u32 data;
+    __u32 raw[2];
+    __u32 bits;
+    __u32 status;
+    __u32 port;
+    __u64 timestamp_ns;
+};
+
+/* The action in the high 16 bits of the return value, its argument in the low ones */
+#define WIEGAND_FILTER_ACTION       0xffff0000
+#define WIEGAND_FILTER_ARG          0x0000ffff
+/* Unknown actions drop too */
+#define WIEGAND_FILTER_DROP         0x00000000
+#define WIEGAND_FILTER_DELIVER      0x00010000
+/* Deliver with the tag, 1 to 15, in the status */
+#define WIEGAND_FILTER_TAG          0x00020000
+/* Send data on the wiegand_out port of the argument instead of delivering it */
+#define WIEGAND_FILTER_REDIRECT     0x00030000
+
+/* ioctl command */
+#define WIEGAND_IOC_MAGIC  'w'
+
+#define WIEGAND_PULSE_WIDTH     _IOW(WIEGAND_IOC_MAGIC, 1, int)
+#define WIEGAND_PULSE_INTERVAL  _IOW(WIEGAND_IOC_MAGIC, 2, int)
+#define WIEGAND_FORMAT          _IOW(WIEGAND_IOC_MAGIC, 3, int)
+#define WIEGAND_READ            _IOR(WIEGAND_IOC_MAGIC, 4, unsigned int)
+#define WIEGAND_WRITE           _IOW(WIEGAND_IOC_MAGIC, 5, unsigned int)
+#define WIEGAND_STATUS          _IOR(WIEGAND_IOC_MAGIC, 6, int)
+/* Dequeue one frame, blocks until one is available */
+#define WIEGAND_READ_FRAME      _IOR(WIEGAND_IOC_MAGIC, 7, struct wiegand_frame)
+/* Dequeue up to count frames, blocks for the first one unless O_NONBLOCK, returns the number read */
+#define WIEGAND_READ_FRAMES     _IOW(WIEGAND_IOC_MAGIC, 8, struct wiegand_frames)
+#define WIEGAND_GET_VERSION     _IOR(WIEGAND_IOC_MAGIC, 9, __u32)
+#define WIEGAND_GET_CONFIG      _IOR(WIEGAND_IOC_MAGIC, 10, struct wiegand_config)
+/* Replace all fields at once, a frame in progress keeps the old ones */
+#define WIEGAND_SET_CONFIG      _IOW(WIEGAND_IOC_MAGIC, 11, struct wiegand_config)
+/* wiegand_in only, non-blocking reads still return whatever is queued */
+#define WIEGAND_GET_COALESCE    _IOR(WIEGAND_IOC_MAGIC, 12, struct wiegand_coalesce)
+#define WIEGAND_SET_COALESCE    _IOW(WIEGAND_IOC_MAGIC, 13, struct wiegand_coalesce)
+
+/* Hub only */
+#define WIEGAND_HUB_GET_PORTS   _IOR(WIEGAND_IOC_MAGIC, 14, struct wiegand_hub_ports)
+
+/* wiegand_in only, replaces the filter of the port for every reader */
+#define WIEGAND_SET_FILTER      _IOW(WIEGAND_IOC_MAGIC, 15, struct wiegand_filter)
+
+#define WIEGAND_IOC_MAXNR 15
+
+#endif /* _WIEGAND_UAPI_H */